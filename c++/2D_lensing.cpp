@@ -111,10 +111,18 @@ struct BlackHole {
     }
 };
 BlackHole SagA(vec3(0.0f, 0.0f, 0.0f), 8.54e36); // Sagittarius A black hole
+
+// -- Geometrized units -- //
+// Rays integrate in units of SagA's Schwarzschild radius (r_s = 1); positions
+// are converted back to metres only for drawing.
+const double RS = 1.0;
+inline double toGeom(double metres) { return metres / SagA.r_s; }
+inline double toMetres(double geom) { return geom * SagA.r_s; }
+
 struct Ray{
-    // -- cartesian coords -- //
+    // -- cartesian coords (metres, for drawing) -- //
     double x;   double y;
-    // -- polar coords -- //
+    // -- polar coords (geometrized) -- //
     double r;   double phi;
     double dr;  double dphi;
     vector<vec2> trail; // trail of points
@@ -122,14 +130,14 @@ struct Ray{
 
     Ray(vec2 pos, vec2 dir) : x(pos.x), y(pos.y), r(sqrt(pos.x * pos.x + pos.y * pos.y)), phi(atan2(pos.y, pos.x)), dr(dir.x), dphi(dir.y) {
         // step 1) get polar coords (r, phi) :
-        this->r = sqrt(x*x + y*y);
+        this->r = toGeom(sqrt(x*x + y*y));
         this->phi = atan2(y, x);
         // step 2) seed velocities :
-        dr = dir.x * cos(phi) + dir.y * sin(phi); // m/s
-        dphi  = ( -dir.x * sin(phi) + dir.y * cos(phi) ) / r;
+        dr = toGeom(dir.x * cos(phi) + dir.y * sin(phi)); // r_s/s
+        dphi  = toGeom( -dir.x * sin(phi) + dir.y * cos(phi) ) / r;
         // step 3) store conserved quantities
         L = r*r * dphi;
-        double f = 1.0 - SagA.r_s/r;  
+        double f = 1.0 - RS/r;  
         double dt_dλ = sqrt( (dr*dr)/(f*f) + (r*r*dphi*dphi)/f );
         E = f * dt_dλ;
         // step 4) start trail :
@@ -172,9 +180,9 @@ struct Ray{
         if(r <= rs) return; // stop if inside the event horizon
         rk4Step(*this, dλ, rs);
 
-        // 2) convert back to cartesian x,y
-        x = r * cos(phi);
-        y = r * sin(phi);
+        // 2) convert back to cartesian x,y in metres
+        x = toMetres(r * cos(phi));
+        y = toMetres(r * sin(phi));
 
         // 3) record the trail
         trail.push_back({ float(x), float(y) });
@@ -306,7 +314,7 @@ int main () {
         SagA.draw();
 
         for (auto& ray : rays) {
-            ray.step(1.0f, SagA.r_s);
+            ray.step(1.0f, RS);
             ray.draw(rays);
         }
 
@@ -102,6 +102,10 @@ struct Camera {
 Camera camera;
 
 struct Ray;
+// The geodesic state is integrated in geometrized units (r_s = 1). It stays
+// in double: rescaling changes magnitudes, not relative precision, and the
+// photon-sphere orbits near r = 1.5 are sensitive to rounding.
+const double RS = 1.0;
 void rk4Step(Ray& ray, double dλ, double rs);
 
 struct Engine {
@@ -264,6 +268,11 @@ struct BlackHole {
     }
 };
 BlackHole SagA(vec3(0.0f, 0.0f, 0.0f), 8.54e36); // Sagittarius A black hole
+
+// -- Geometrized units -- //
+// Convert metres to units of SagA's Schwarzschild radius at the camera boundary.
+inline vec3 toGeom(const vec3& metres) { return vec3(dvec3(metres) / SagA.r_s); }
+
 struct Ray{
     // -- cartesian coords -- //
     double x;   double y; double z;
@@ -272,6 +281,7 @@ struct Ray{
     double dr;  double dphi; double dtheta;
     double E, L;             // conserved quantities
 
+    // pos is in geometrized units, dir is a unit vector
     Ray(vec3 pos, vec3 dir) : x(pos.x), y(pos.y), z(pos.z) {
         // Step 1: get spherical coords (r, theta, phi)
         r = sqrt(x*x + y*y + z*z);
@@ -289,7 +299,7 @@ struct Ray{
 
         // Step 3: store conserved quantities
         L = r * r * sin(theta) * dphi;
-        double f = 1.0 - SagA.r_s / r;
+        double f = 1.0 - RS / r;
         double dt_dλ = sqrt((dr*dr)/f + r*r*dtheta*dtheta + r*r*sin(theta)*sin(theta)*dphi*dphi);
         E = f * dt_dλ;
     }
@@ -307,6 +317,7 @@ void raytrace(vector<unsigned char>& pixels, int W, int H) {
     pixels.resize(W * H * 3);
 
     // build camera basis
+    vec3 camPos  = toGeom(camera.pos);
     vec3 forward = normalize(camera.target - camera.pos);
     vec3 right   = normalize(cross(forward, vec3(0,1,0)));
     vec3 up      = cross(right, forward);
@@ -322,17 +333,17 @@ void raytrace(vector<unsigned char>& pixels, int W, int H) {
             vec3 dir = normalize(u*right + v*up + forward);
 
             // construct your Ray
-            Ray ray(camera.pos,  dir);
+            Ray ray(camPos,  dir);
 
             const int MAX_STEPS = 10000;
-            const double D_LAMBDA = 1e7;
-            const double ESCAPE_R = 1e14;
+            const double D_LAMBDA = 1e7 / SagA.r_s;
+            const double ESCAPE_R = 1e14 / SagA.r_s;
 
             // 2) march the ray forward in λ
             vec3 color(0.0f);
             if (!useGeodesics) {
-                double b = 2.0 * dot(camera.pos, dir);
-                double c0 = dot(camera.pos, camera.pos) - SagA.r_s*SagA.r_s;
+                double b = 2.0 * dot(camPos, dir);
+                double c0 = dot(camPos, camPos) - RS*RS;
                 double disc = b*b - 4.0*c0;
                 if (disc > 0.0) {
                     double t1 = (-b - sqrt(disc)) * 0.5;
@@ -343,13 +354,13 @@ void raytrace(vector<unsigned char>& pixels, int W, int H) {
             }
             else {
                 // full null‐geodesic march
-                Ray ray(camera.pos, dir);
+                Ray ray(camPos, dir);
                 for(int i = 0; i < MAX_STEPS; ++i) {
-                    if (SagA.Intercept(ray.x, ray.y, ray.z)) {
+                    if (ray.r <= RS) {
                         color = vec3(1.0f, 0.0f, 0.0f);
                         break;
                     }
-                    ray.step(D_LAMBDA, SagA.r_s);
+                    ray.step(D_LAMBDA, RS);
                     if (ray.r > ESCAPE_R) {
                         // escaped to infinity → remains black
                         break;
@@ -6,6 +6,7 @@
 #include <vector>
 #include <iostream>
 #include <cmath>
+#include "../../sim_thread.h"
 // #include <cuda_runtime.h>
 // #include <cuda_gl_interop.h>
 // #include <device_launch_parameters.h>
@@ -335,11 +336,6 @@ struct Object{
     vec3 getNormal(vec3 &point) const{
         return normalize(point - position);
     }
-    void UpdatePos(){
-        this->position[0] += this->velocity[0];
-        this->position[1] += this->velocity[1];
-        this->position[2] += this->velocity[2];
-    }
     // gravity
     void accelerate(float x, float y, float z){
         this->velocity[0] += x;
@@ -436,6 +432,43 @@ public:
     };
 };
 
+// -- physics thread -- //
+// Object motion runs at a fixed PHYSICS_HZ on its own thread instead of once
+// per rendered frame, so the slow CPU trace no longer slows the objects.
+// Each tick moves every object by its velocity and bounces it off the
+// y = 0 floor; positions are handed to the renderer through a triple buffer.
+const double PHYSICS_HZ = 60.0;
+struct ScenePhysics {
+    vector<vec3> position, velocity;     // physics thread only
+    sim::TripleBuffer<vector<vec3>> positions;
+    sim::FixedStepLoop loop;
+
+    void start(const vector<Object>& objs) {
+        for (const auto& obj : objs) {
+            position.push_back(obj.position);
+            velocity.push_back(obj.velocity);
+        }
+        loop.start(PHYSICS_HZ, [this]() { tick(); });
+    }
+    void tick() {
+        for (size_t i = 0; i < position.size(); ++i) {
+            if (position[i].y > 0) {
+                velocity[i] *= -0.8f;
+                position[i].y = 0.1f;
+            }
+            position[i] += velocity[i];
+        }
+        positions.back() = position;
+        positions.publish();
+    }
+    // Render thread: copy the newest positions into the scene
+    void read(vector<Object>& objs) {
+        if (!positions.update()) return;
+        const vector<vec3>& p = positions.front();
+        for (size_t i = 0; i < p.size() && i < objs.size(); ++i) objs[i].position = p[i];
+    }
+};
+
 // --- main loop ---- //
 int main(){
     Engine engine;
@@ -457,6 +490,8 @@ int main(){
         // black hole
         Object(vec3(0.0f, 15.0f, 0.0f), vec3(0.0f), bhRad, Material(vec3(0.0f), 0.9f, 10.0f), bhMass),
     };
+    ScenePhysics physics;
+    physics.start(scene.objs);
     // -- loop -- //
     double lastFrame = glfwGetTime();
     while(!glfwWindowShouldClose(engine.window)){
@@ -469,6 +504,8 @@ int main(){
         int rHeight = engine.OptimizeMovement(camera.lastMovementTime)[1];
         std::vector<unsigned char> pixels(rWidth * rHeight * 3);
 
+        physics.read(scene.objs);
+
         // Update light sources
         scene.lights.clear();
         for (const auto& obj : scene.objs) {
@@ -519,34 +556,9 @@ int main(){
             }
         }
 
-        for(auto& obj : scene.objs) {
-            if(obj.position[1] > 0){
-                obj.velocity *= -0.8f;
-                obj.position[1] = 0.1f;
-            }
-            for(auto& obj2 : scene.objs){
-                if(&obj2 != &obj){
-                    float dx = obj2.position[0] - obj.position[0];
-                    float dy = obj2.position[1] - obj.position[1];
-                    float dz = obj2.position[2] - obj.position[2];
-                    float distance = sqrt(dx * dx + dy * dy + dz * dz);
-                    if (distance > 0) {
-                        std::vector<float> direction = {dx / distance, dy / distance, dz / distance};
-                        distance *= 1000;
-                        double Gforce = (G * obj.mass * obj2.mass) / (distance * distance);
-                        
-                        float acc1 = Gforce / obj.mass;
-                        std::vector<float> acc = {direction[0] * acc1, direction[1]*acc1, direction[2]*acc1};
-                        //obj.accelerate(acc[0] * deltaTime * pow(1, -15), acc[1] * deltaTime * pow(1, -15), acc[2] * deltaTime * pow(1, -15));
-                        //collision
-                    }
-                }
-            }
-            //obj.accelerate(0.0, 9.81 * deltaTime, 0.0);
-            obj.UpdatePos();
-        }
         engine.renderScene(pixels, rWidth, rHeight);
     }
+    physics.loop.stop();
     glfwTerminate();
 }
 
@@ -3,8 +3,24 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
 #include <vector>
 #include <iostream>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "../../gl_state.h"
+#include "../../nbody.h"
+#include "../../recording.h"
+#include "../../sim_thread.h"
+#include "../../scene.h"
+#include "../../telemetry.h"
+#include "../../well_tree.h"
 
 const char* vertexShaderSource = R"glsl(
 #version 330 core
@@ -39,8 +55,108 @@ void main() {
         FragColor = vec4(objectColor.rgb * fade, objectColor.a);
     }})glsl";
 
+// Bodies: one shared unit sphere, placed, scaled and coloured per instance
+const char* sphereVertexShaderSource = R"glsl(
+#version 330 core
+layout(location=0) in vec3 aPos;
+layout(location=1) in vec4 instancePosRadius;
+layout(location=2) in vec4 instanceColor;
+layout(location=3) in float instanceGlow;
+uniform mat4 view;
+uniform mat4 projection;
+out float lightIntensity;
+out vec4 objectColor;
+out float glow;
+void main() {
+    vec3 worldPos = instancePosRadius.xyz + aPos * instancePosRadius.w;
+    gl_Position = projection * view * vec4(worldPos, 1.0);
+    vec3 dirToCenter = normalize(-worldPos);
+    lightIntensity = max(dot(aPos, dirToCenter), 0.3);
+    objectColor = instanceColor;
+    glow = instanceGlow;})glsl";
+
+const char* sphereFragmentShaderSource = R"glsl(
+#version 330 core
+in float lightIntensity;
+in vec4 objectColor;
+in float glow;
+out vec4 FragColor;
+void main() {
+    if (glow > 0.5) {
+        FragColor = vec4(objectColor.rgb * 10000000, objectColor.a);
+    } else {
+        float fade = smoothstep(0.0, 10.0, lightIntensity*10);
+        FragColor = vec4(objectColor.rgb * fade, objectColor.a);
+    }})glsl";
+
+// Bodies as impostors: a quad facing the eye, just large enough to hold the
+// sphere's silhouette, on which the fragment shader intersects the view ray
+// with the exact sphere and writes its depth. Four vertices per body at any
+// zoom, and no facets. Shading matches the mesh shader above.
+const char* impostorVertexShaderSource = R"glsl(
+#version 330 core
+layout(location=0) in vec2 aCorner;
+layout(location=1) in vec4 instancePosRadius;
+layout(location=2) in vec4 instanceColor;
+layout(location=3) in float instanceGlow;
+uniform mat4 view;
+uniform mat4 projection;
+out vec3 quadPos;
+flat out vec3 center;
+flat out float radius;
+flat out vec4 objectColor;
+flat out float glow;
+void main() {
+    center = (view * vec4(instancePosRadius.xyz, 1.0)).xyz;
+    radius = instancePosRadius.w;
+    // through the centre, perpendicular to the line of sight: the silhouette
+    // cone cuts this plane in a circle of radius r d / sqrt(d^2 - r^2)
+    float d = length(center);
+    vec3 dir = center / d;
+    vec3 right = normalize(cross(dir, abs(dir.y) < 0.99 ? vec3(0.0, 1.0, 0.0) : vec3(1.0, 0.0, 0.0)));
+    vec3 up = cross(right, dir);
+    float halfSize = radius * d / sqrt(max(d * d - radius * radius, 1e-6 * radius * radius));
+    quadPos = center + (aCorner.x * right + aCorner.y * up) * halfSize;
+    gl_Position = projection * vec4(quadPos, 1.0);
+    objectColor = instanceColor;
+    glow = instanceGlow;})glsl";
+
+const char* impostorFragmentShaderSource = R"glsl(
+#version 330 core
+in vec3 quadPos;
+flat in vec3 center;
+flat in float radius;
+flat in vec4 objectColor;
+flat in float glow;
+uniform mat4 view;
+uniform mat4 projection;
+out vec4 FragColor;
+void main() {
+    // eye ray against the sphere; the discriminant from the closest approach
+    // rather than b^2 - |c|^2 + r^2, which cancels badly far from the eye
+    vec3 ray = normalize(quadPos);
+    float b = dot(ray, center);
+    vec3 miss = center - b * ray;
+    float disc = radius * radius - dot(miss, miss);
+    if (disc < 0.0) discard;
+    vec3 hit = ray * (b - sqrt(disc));
+    vec4 clip = projection * vec4(hit, 1.0);
+    gl_FragDepth = 0.5 * clip.z / clip.w + 0.5;
+
+    mat3 toWorld = transpose(mat3(view));
+    vec3 normal = toWorld * ((hit - center) / radius);
+    vec3 worldPos = toWorld * (hit - view[3].xyz);
+    float lightIntensity = max(dot(normal, normalize(-worldPos)), 0.3);
+    if (glow > 0.5) {
+        FragColor = vec4(objectColor.rgb * 10000000, objectColor.a);
+    } else {
+        float fade = smoothstep(0.0, 10.0, lightIntensity*10);
+        FragColor = vec4(objectColor.rgb * fade, objectColor.a);
+    }})glsl";
+
 bool running = true;
 bool pause = true;
+bool impostors = true;  // I toggles between impostors and sphere meshes
 glm::vec3 cameraPos   = glm::vec3(0.0f, 0.0f,  1.0f);
 glm::vec3 cameraFront = glm::vec3(0.0f, 0.0f, -1.0f);
 glm::vec3 cameraUp    = glm::vec3(0.0f, 1.0f,  0.0f);
@@ -54,31 +170,79 @@ const double G = 6.6743e-11; // m^3 kg^-1 s^-2
 const float c = 299792458.0;
 float initMass = float(pow(10, 23));
 float sizeRatio = 30000.0f;
+uint32_t nextObjectId = 0;
+// Telemetry events (telemetry.h), logged instead of printed from the loop
+uint16_t radiusEvent, massEvent;
 
 GLFWwindow* StartGLU();
 GLuint CreateShaderProgram(const char* vertexSource, const char* fragmentSource);
 void CreateVBOVAO(GLuint& VAO, GLuint& VBO, const float* vertices, size_t vertexCount);
-void UpdateCam(GLuint shaderProgram, glm::vec3 cameraPos);
+glm::mat4 ViewMatrix(glm::vec3 cameraPos);
+void UpdateCam(glstate::Program& program, glm::vec3 cameraPos);
 void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods);
 void mouseButtonCallback(GLFWwindow* window, int button, int action, int mods);
 void scroll_callback(GLFWwindow* window, double xoffset, double yoffset);
 
 void mouse_callback(GLFWwindow* window, double xpos, double ypos);
 glm::vec3 sphericalToCartesian(float r, float theta, float phi);
-void DrawGrid(GLuint shaderProgram, GLuint gridVAO, size_t vertexCount);
+void DrawGrid(glstate::Program& program, GLuint gridVAO, size_t vertexCount);
+
+// Per-body data for the instanced sphere draw (layout matches the sphere shader)
+struct SphereInstance {
+    glm::vec4 posRadius;
+    glm::vec4 color;
+    float glow;
+};
+// Unit spheres of decreasing tessellation shared by every body, in one
+// vertex and index buffer. A body outside the view frustum is skipped, and a
+// visible one gets the coarsest level whose silhouette error, r (1 - cos(pi /
+// segments)) in pixels, stays under SPHERE_LOD_ERROR. Visible instances are
+// grouped by level so a whole frame is one multi-draw-indirect call (one
+// instanced draw per level without GL 4.3 / ARB_multi_draw_indirect).
+const int SPHERE_LODS = 4;
+const int SPHERE_LOD_SEGMENTS[SPHERE_LODS] = { 25, 12, 6, 4 };
+const float SPHERE_LOD_ERROR = 0.5f;    // pixels
+struct DrawElementsIndirectCommand {
+    GLuint count, instanceCount, firstIndex;
+    GLint baseVertex;
+    GLuint baseInstance;
+};
+struct SphereMesh {
+    struct Lod {
+        GLuint firstIndex = 0;
+        GLint baseVertex = 0;
+        GLsizei indexCount = 0;
+        float maxPixels = 0.0f;         // largest projected radius it is good for
+    };
+    GLuint VAO = 0, VBO = 0, EBO = 0, instanceVBO = 0, indirectBuffer = 0;
+    GLuint impostorVAO = 0, impostorVBO = 0;     // one quad, same instance attributes
+    Lod lods[SPHERE_LODS];
+    bool multiDraw = false;
+    std::vector<SphereInstance> candidates;  // every body, filled by the caller
+    std::vector<SphereInstance> instances;   // visible ones, grouped by level
+    std::vector<int> lodOf;                  // per candidate, -1 if culled
+    GLuint lodFirst[SPHERE_LODS], lodCount[SPHERE_LODS];
+};
+void CreateSphereMesh(SphereMesh& mesh);
+void DestroySphereMesh(SphereMesh& mesh);
+// Cull mesh.candidates and pick their levels; returns the number visible
+size_t CullSpheres(SphereMesh& mesh, const glm::mat4& viewProj, glm::vec3 eye, float pixelsPerUnit);
+void DrawSpheres(SphereMesh& mesh, bool impostors);
 
 
 class Object {
     public:
-        GLuint VAO, VBO;
         glm::vec3 position = glm::vec3(400, 300, 0);
         glm::vec3 velocity = glm::vec3(0, 0, 0);
-        size_t vertexCount;
         glm::vec4 color = glm::vec4(1.0f, 0.0f, 0.0f, 1.0f);
 
         bool Initalizing = false;
         bool Launched = false;
         bool target = false;
+        uint32_t id;          // body id on the physics thread
+        bool simulated = false;
+        uint64_t addedAt = 0; // physics command that added it
+        bool absorbed = false;
 
         float mass;
         float density;  // kg / m^3  HYDROGEN
@@ -92,108 +256,311 @@ class Object {
             this->velocity = initVelocity;
             this->mass = mass;
             this->density = density;
-            this->radius = pow(((3 * this->mass/this->density)/(4 * 3.14159265359)), (1.0f/3.0f)) / sizeRatio;
+            this->radius = RadiusFor(mass, density);
             this->color = color;
             this->glow = Glow;
-            
-
-            // Generate vertices (centered at origin)
-            std::vector<float> vertices = Draw();
-            vertexCount = vertices.size();
-
-            CreateVBOVAO(VAO, VBO, vertices.data(), vertexCount);
+            this->id = nextObjectId++;
         }
 
-        std::vector<float> Draw() {
-            std::vector<float> vertices;
-            int stacks = 25;
-            int sectors = 25;
-            
-            for(float i = 0.0f; i <= stacks; ++i){
-                float theta1 = (i / stacks) * glm::pi<float>();
-                float theta2 = (i+1) / stacks * glm::pi<float>();
-                for (float j = 0.0f; j < sectors; ++j){
-                    float phi1 = j / sectors * 2 * glm::pi<float>();
-                    float phi2 = (j+1) / sectors * 2 * glm::pi<float>();
-                    glm::vec3 v1 = sphericalToCartesian(this->radius, theta1, phi1);
-                    glm::vec3 v2 = sphericalToCartesian(this->radius, theta1, phi2);
-                    glm::vec3 v3 = sphericalToCartesian(this->radius, theta2, phi1);
-                    glm::vec3 v4 = sphericalToCartesian(this->radius, theta2, phi2);
-
-                    // Triangle 1: v1-v2-v3
-                    vertices.insert(vertices.end(), {v1.x, v1.y, v1.z}); //      /|
-                    vertices.insert(vertices.end(), {v2.x, v2.y, v2.z}); //     / |
-                    vertices.insert(vertices.end(), {v3.x, v3.y, v3.z}); //    /__|
-                    
-                    // Triangle 2: v2-v4-v3
-                    vertices.insert(vertices.end(), {v2.x, v2.y, v2.z});
-                    vertices.insert(vertices.end(), {v4.x, v4.y, v4.z});
-                    vertices.insert(vertices.end(), {v3.x, v3.y, v3.z});
-                }   
-            }
-            return vertices;
-        }
-        
-        void UpdatePos(){
-            this->position[0] += this->velocity[0] / 94;
-            this->position[1] += this->velocity[1] / 94;
-            this->position[2] += this->velocity[2] / 94;
-            this->radius = pow(((3 * this->mass/this->density)/(4 * 3.14159265359)), (1.0f/3.0f)) / sizeRatio;
+        // Radius of a uniform sphere of this mass and density, in scene units
+        static float RadiusFor(float mass, float density) {
+            return pow(((3 * mass/density)/(4 * 3.14159265359)), (1.0f/3.0f)) / sizeRatio;
         }
-        void UpdateVertices() {
-            // Generate new vertices with current radius
-            std::vector<float> vertices = Draw();
-            
-            // Update the VBO with new vertex data
-            glBindBuffer(GL_ARRAY_BUFFER, VBO);
-            glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float), vertices.data(), GL_STATIC_DRAW);
+        // The mesh is a shared unit sphere scaled per instance, so a mass
+        // change only has to update the radius
+        void SetMass(float m) {
+            mass = m;
+            radius = RadiusFor(mass, density);
         }
         glm::vec3 GetPos() const {
             return this->position;
         }
-        void accelerate(float x, float y, float z){
-            this->velocity[0] += x / 96;
-            this->velocity[1] += y / 96;
-            this->velocity[2] += z / 96;
-        }
-        float CheckCollision(const Object& other) {
-            float dx = other.position[0] - this->position[0];
-            float dy = other.position[1] - this->position[1];
-            float dz = other.position[2] - this->position[2];
-            float distance = std::pow(dx*dx + dy*dy + dz*dz, (1.0f/2.0f));
-            // if (other.radius + this->radius > distance){
-            //     return -0.2f;
-            // }
-            return 1.0f;
-        }
 };
 std::vector<Object> objs = {};
 
-std::vector<float> CreateGridVertices(float size, int divisions, const std::vector<Object>& objs);
-std::vector<float> UpdateGridVertices(std::vector<float> vertices, const std::vector<Object>& objs, float halfSize, float originalY);
+// Gravity for every settled body runs on its own thread at PHYSICS_HZ.
+// The old per-frame update (v += a / 96, x += v / 94 with x in km and a in
+// m/s^2) was tuned for 96 fps; in SI units that is a leapfrog step of
+// sqrt(1000 / (94 * 96)) s per tick with velocities scaled by 96 * dt, so
+// one tick here reproduces one frame there at any frame rate.
+const double PHYSICS_HZ = 96.0;
+const double PHYSICS_DT = std::sqrt(1000.0 / (94.0 * 96.0));  // simulated s per tick
+const double VELOCITY_SCALE = 96.0 * PHYSICS_DT;              // scene velocity units -> m/s
+sim::PhysicsThread physics;
+sim::Snapshot physicsView;
+
+// Hand a released body to the physics thread (scene units are km). It
+// collides at the radius it is drawn with.
+void StartSimulating(Object& obj) {
+    glm::dvec3 p = glm::dvec3(obj.position) * 1000.0;
+    glm::dvec3 v = glm::dvec3(obj.velocity) * VELOCITY_SCALE;
+    obj.addedAt = physics.add({ obj.id, p.x, p.y, p.z, v.x, v.y, v.z, obj.mass, obj.radius * 1000.0 });
+    obj.simulated = true;
+}
+// --record <file> writes every physics tick to a recording (recording.h);
+// --replay <file> plays one back at the recorded rate instead of running the
+// physics, looping at the end. Bodies launched during the recorded run are
+// created as they appear, with the default colour. P pauses the replay.
+const double RECORD_POSITION_STEP = 10.0;     // m; scene units are km
+const double RECORD_VELOCITY_STEP = 1e-3;     // m/s
+recording::Writer recorder;
+recording::Reader replay;
+bool replaying = false;
+double replayTicks = 0.0;
+
+// Copy a snapshot into objs. Both lists are in ascending id order.
+// Mass and radius come back too, since bodies grow by merging; a body the
+// physics thread has taken in but no longer lists was absorbed and is dropped.
+// A replay also lists bodies objs has never seen, which are created.
+void ApplySnapshot(const sim::Snapshot& s) {
+    size_t k = 0;
+    bool absorbed = false;
+    std::vector<size_t> unknown;
+    for (auto& obj : objs) {
+        for (; k < s.id.size() && s.id[k] < obj.id; ++k) unknown.push_back(k);
+        if (k == s.id.size() || s.id[k] != obj.id) {
+            obj.absorbed = obj.simulated && s.commands >= obj.addedAt;
+            absorbed |= obj.absorbed;
+            continue;
+        }
+        obj.position = glm::vec3(glm::dvec3(s.x[k], s.y[k], s.z[k]) / 1000.0);
+        obj.velocity = glm::vec3(glm::dvec3(s.vx[k], s.vy[k], s.vz[k]) / VELOCITY_SCALE);
+        obj.mass = float(s.m[k]);
+        obj.radius = float(s.r[k] / 1000.0);
+        ++k;
+    }
+    for (; k < s.id.size(); ++k) unknown.push_back(k);
+    if (absorbed)
+        objs.erase(std::remove_if(objs.begin(), objs.end(), [](const Object& obj) { return obj.absorbed; }), objs.end());
+    if (!replaying) return;     // not yet taken in by the physics thread
+    for (size_t u : unknown) {
+        Object obj(glm::vec3(glm::dvec3(s.x[u], s.y[u], s.z[u]) / 1000.0),
+                   glm::vec3(glm::dvec3(s.vx[u], s.vy[u], s.vz[u]) / VELOCITY_SCALE), float(s.m[u]));
+        obj.id = s.id[u];
+        obj.radius = float(s.r[u] / 1000.0);
+        obj.simulated = true;
+        nextObjectId = std::max(nextObjectId, obj.id + 1);
+        auto at = std::upper_bound(objs.begin(), objs.end(), obj.id, [](uint32_t id, const Object& o) { return id < o.id; });
+        objs.insert(at, obj);
+    }
+}
+void ReadPhysics() {
+    physics.poll();
+    physics.blend(sim::wallSeconds(), physicsView);
+    ApplySnapshot(physicsView);
+}
+void ReadReplay(double dt) {
+    if (!pause) replayTicks += dt * replay.header().ticksPerSecond;
+    uint64_t tick = replay.firstTick() + uint64_t(replayTicks);
+    if (tick > replay.lastTick()) {
+        replayTicks = 0.0;
+        tick = replay.firstTick();
+    }
+    if (replay.frameAt(tick, physicsView)) ApplySnapshot(physicsView);
+}
 
-GLuint gridVAO, gridVBO;
+// --headless <ticks> steps the loaded bodies on this thread as fast as it
+// can, with no window, and prints the throughput and how well energy and
+// momentum held. It uses the same dt and G as the physics thread. Collisions
+// are left out, so the drift figures measure the solver and integrator
+// alone. --solver and --threads pick the force kernel and OpenMP thread
+// count; --dump <file> writes a recording (see --replay) every --dump-every
+// ticks, outside the timed part.
+struct HeadlessOptions {
+    long long ticks = 0;
+    nbody::Solver solver = nbody::Solver::Direct;
+    int threads = 0;              // 0 for the OpenMP default
+    const char* dumpPath = nullptr;
+    long long dumpEvery = 1;
+};
 
+static void Momentum(const nbody::Bodies& b, double p[3], double& scale) {
+    p[0] = p[1] = p[2] = 0.0;
+    scale = 0.0;
+    for (size_t i = 0; i < b.size(); ++i) {
+        p[0] += b.m[i] * b.vx[i];  p[1] += b.m[i] * b.vy[i];  p[2] += b.m[i] * b.vz[i];
+        scale += b.m[i] * std::sqrt(b.vx[i] * b.vx[i] + b.vy[i] * b.vy[i] + b.vz[i] * b.vz[i]);
+    }
+}
 
-int main() {
-    GLFWwindow* window = StartGLU();
-    GLuint shaderProgram = CreateShaderProgram(vertexShaderSource, fragmentShaderSource);
+int RunHeadless(const HeadlessOptions& opt) {
+#ifdef _OPENMP
+    if (opt.threads > 0) omp_set_num_threads(opt.threads);
+    const int threads = omp_get_max_threads();
+#else
+    if (opt.threads > 1)
+        fprintf(stderr, "--threads %d ignored: built without OpenMP (make OMPFLAGS=-fopenmp)\n", opt.threads);
+    const int threads = 1;
+#endif
+    nbody::System sys;
+    sys.config.G = G;
+    sys.config.solver = opt.solver;
+    const size_t n = objs.size();
+    sys.bodies.resize(n);
+    sim::Snapshot dump;
+    for (size_t i = 0; i < n; ++i) {
+        glm::dvec3 p = glm::dvec3(objs[i].position) * 1000.0;
+        glm::dvec3 v = glm::dvec3(objs[i].velocity) * VELOCITY_SCALE;
+        sys.bodies.x[i] = p.x;  sys.bodies.y[i] = p.y;  sys.bodies.z[i] = p.z;
+        sys.bodies.vx[i] = v.x; sys.bodies.vy[i] = v.y; sys.bodies.vz[i] = v.z;
+        sys.bodies.m[i] = objs[i].mass;
+        dump.id.push_back(objs[i].id);
+        dump.r.push_back(objs[i].radius * 1000.0);
+    }
+    recording::Writer writer;
+    writer.lossless = true;
+    if (opt.dumpPath && !writer.open(opt.dumpPath, PHYSICS_HZ, RECORD_POSITION_STEP, RECORD_VELOCITY_STEP)) {
+        std::cerr << "Could not open dump: " << opt.dumpPath << std::endl;
+        return 1;
+    }
+    auto record = [&](long long tick) {
+        const nbody::Bodies& b = sys.bodies;
+        dump.tick = uint64_t(tick);
+        dump.time = double(tick) * PHYSICS_DT;
+        dump.x = b.x; dump.y = b.y; dump.z = b.z;
+        dump.vx = b.vx; dump.vy = b.vy; dump.vz = b.vz;
+        dump.m = b.m;
+        writer.push(dump);
+    };
 
-    GLint modelLoc = glGetUniformLocation(shaderProgram, "model");
-    GLint objectColorLoc = glGetUniformLocation(shaderProgram, "objectColor");
-    glUseProgram(shaderProgram);
+    const double e0 = sys.energy();
+    double p0[3], p1[3], pScale;
+    Momentum(sys.bodies, p0, pScale);
+    sys.computeAccelerations();     // step() needs them; also sizes the solver scratch
+    if (opt.dumpPath) record(0);
+    double seconds = 0.0;
+    for (long long t = 1; t <= opt.ticks; ++t) {
+        auto t0 = std::chrono::steady_clock::now();
+        sys.step(PHYSICS_DT);
+        seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        if (opt.dumpPath && t % opt.dumpEvery == 0) record(t);
+    }
+    writer.close();
+    const double e1 = sys.energy();
+    double unused;
+    Momentum(sys.bodies, p1, unused);
+
+    const double energyDrift = e0 != 0.0 ? std::abs((e1 - e0) / e0) : std::abs(e1 - e0);
+    const double dp = std::sqrt((p1[0] - p0[0]) * (p1[0] - p0[0]) + (p1[1] - p0[1]) * (p1[1] - p0[1]) +
+                                (p1[2] - p0[2]) * (p1[2] - p0[2]));
+    const double momentumDrift = pScale > 0.0 ? dp / pScale : dp;
+    const double ticksPerSecond = seconds > 0.0 ? double(opt.ticks) / seconds : 0.0;
+    // pair interactions a direct sum would do, so the solvers compare on one scale
+    const double interactionsPerSecond = ticksPerSecond * double(n) * double(n > 0 ? n - 1 : 0);
+    printf("%10s  %-11s %7s %10s %12s %12s %14s %12s %12s\n", "N", "solver", "threads", "ticks",
+           "ms/tick", "ticks/s", "interactions/s", "dE/E", "dP/sum|p|");
+    printf("%10zu  %-11s %7d %10lld %12.3f %12.2f %14.3e %12.3e %12.3e\n", n, nbody::solverName(opt.solver),
+           threads, opt.ticks, opt.ticks > 0 ? 1e3 * seconds / double(opt.ticks) : 0.0, ticksPerSecond,
+           interactionsPerSecond, energyDrift, momentumDrift);
+    return 0;
+}
 
-    glfwSetCursorPosCallback(window, mouse_callback);
-    glfwSetScrollCallback(window, scroll_callback);
-    glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+// --scene <file> replaces the built-in objects with a binary scene (format in
+// scene.h, written by scene_convert) and places the camera if the file sets
+// one. Sizes follow from mass and density as for any other object, and the
+// file's black hole, which this view does not draw, is ignored.
+bool LoadScene(const char* path) {
+    scene::File file;
+    std::string error;
+    if (!file.open(path, error)) {
+        std::cerr << error << std::endl;
+        return false;
+    }
+    const size_t n = file.size();
+    const double* x = file.column(scene::X);
+    const double* y = file.column(scene::Y);
+    const double* z = file.column(scene::Z);
+    const double* vx = file.column(scene::VX);
+    const double* vy = file.column(scene::VY);
+    const double* vz = file.column(scene::VZ);
+    const double* mass = file.column(scene::MASS);
+    const double* density = file.column(scene::DENSITY);
+    const float* rgba = file.color();
+    objs.clear();
+    objs.reserve(n);
+    for (size_t i = 0; i < n; ++i) {
+        glm::vec3 p = glm::vec3(glm::dvec3(x[i], y[i], z[i]) / 1000.0);
+        glm::vec3 v = glm::vec3(glm::dvec3(vx[i], vy[i], vz[i]) / VELOCITY_SCALE);
+        glm::vec4 color(rgba[4 * i], rgba[4 * i + 1], rgba[4 * i + 2], rgba[4 * i + 3]);
+        objs.emplace_back(p, v, float(mass[i]), float(density[i] > 0.0 ? density[i] : 3344.0), color);
+    }
+    const scene::Header& h = file.header();
+    if (h.flags & scene::HAS_CAMERA) {
+        glm::dvec3 from(h.cameraPosition[0], h.cameraPosition[1], h.cameraPosition[2]);
+        glm::dvec3 to(h.cameraTarget[0], h.cameraTarget[1], h.cameraTarget[2]);
+        cameraPos = glm::vec3(from / 1000.0);
+        if (glm::length(to - from) > 0.0) {
+            cameraFront = glm::vec3(glm::normalize(to - from));
+            pitch = glm::degrees(asin(cameraFront.y));
+            yaw = glm::degrees(atan2(cameraFront.z, cameraFront.x));
+        }
+    }
+    std::cout << "Loaded " << n << " bodies from " << path << std::endl;
+    return true;
+}
 
-    //projection matrix
-    glm::mat4 projection = glm::perspective(glm::radians(45.0f), 800.0f / 600.0f, 0.1f, 750000.0f);
-    GLint projectionLoc = glGetUniformLocation(shaderProgram, "projection");
-    glUniformMatrix4fv(projectionLoc, 1, GL_FALSE, glm::value_ptr(projection));
+std::vector<float> CreateGridVertices(float size, int divisions, const std::vector<Object>& objs);
+
+// Spacetime grid. Each body bends the sheet along Flamm's paraboloid,
+// 2 sqrt(rs (r - rs)) doubled for visibility, and the sum is tilted back so
+// the corners stay put. Heights are evaluated once per lattice point rather
+// than per line vertex, and only in frames where a body moved or changed
+// mass. The sum over bodies goes through a wells::Tree (well_tree.h):
+// nearby bodies exactly, distant clusters as one term, within
+// GRID_TOLERANCE relative error.
+const float GRID_TOLERANCE = 1e-2f;
+struct GridDeformation {
+    int divisions = 0;
+    float step = 0.0f, halfSize = 0.0f, originalY = 0.0f;
+    std::vector<int> vertexLattice;     // lattice point of each line vertex
+    std::vector<float> height;          // per lattice point
+    std::vector<glm::vec4> lastBodies;  // position and mass at the last update
+    std::vector<float> bx, by, bz, rs;  // bodies in metres, input to the tree
+    wells::Tree tree;
+};
+// Deforms vertices in place; false if nothing moved and the VBO is still current
+bool UpdateGridVertices(GridDeformation& grid, std::vector<float>& vertices, const std::vector<Object>& objs);
+
+GLuint gridVAO, gridVBO;
+
+
+int main(int argc, char** argv) {
+    const char* scenePath = nullptr;
+    const char* telemetryPath = nullptr;
+    const char* recordPath = nullptr;
+    const char* replayPath = nullptr;
+    HeadlessOptions headless;
+    for (int i = 1; i < argc; ++i) {
+        if (std::string(argv[i]) == "--scene" && i + 1 < argc) scenePath = argv[++i];
+        else if (std::string(argv[i]) == "--telemetry" && i + 1 < argc) telemetryPath = argv[++i];
+        else if (std::string(argv[i]) == "--record" && i + 1 < argc) recordPath = argv[++i];
+        else if (std::string(argv[i]) == "--replay" && i + 1 < argc) replayPath = argv[++i];
+        else if (std::string(argv[i]) == "--headless" && i + 1 < argc) headless.ticks = atoll(argv[++i]);
+        else if (std::string(argv[i]) == "--threads" && i + 1 < argc) headless.threads = atoi(argv[++i]);
+        else if (std::string(argv[i]) == "--dump" && i + 1 < argc) headless.dumpPath = argv[++i];
+        else if (std::string(argv[i]) == "--dump-every" && i + 1 < argc) headless.dumpEvery = std::max(1LL, atoll(argv[++i]));
+        else if (std::string(argv[i]) == "--solver" && i + 1 < argc) {
+            const char* name = argv[++i];
+            int k = 0;
+            while (k < int(nbody::Solver::Count) && strcmp(nbody::solverName(nbody::Solver(k)), name) != 0) ++k;
+            if (k == int(nbody::Solver::Count)) {
+                std::cerr << "Unknown solver " << name << " (direct, barnes-hut or fmm)" << std::endl;
+                return 1;
+            }
+            headless.solver = nbody::Solver(k);
+        }
+    }
+    radiusEvent = telemetry::define("object.radius", "radius", "mass", 0.1);
+    massEvent = telemetry::define("object.mass", "mass", "");
+    physics.tickEvent = telemetry::define("physics.tick", "ms", "bodies");
+    physics.mergeEvent = telemetry::define("physics.merge", "absorbed", "pairs");
+    const uint16_t glEvent = telemetry::define("gl.calls", "issued", "elided");
+    const uint16_t sphereEvent = telemetry::define("spheres.drawn", "visible", "bodies", 0.1);
+    recorder.frameEvent = telemetry::define("record.frame", "bytes", "keyframe");
+    if (telemetryPath && !telemetry::start(telemetryPath))
+        std::cerr << "Could not open telemetry log: " << telemetryPath << std::endl;
     cameraPos = glm::vec3(0.0f, 5000.0f, 5000.0f);
 
-    
     objs = {
     //     //sun
        //Object(glm::vec3(20000, 0, 0), glm::vec3(0, 0, -13000), 1.989 * pow(10, 25), 1414, glm::vec4(1.0f, 0.929f, 0.176f, 1.0f), true),
@@ -219,6 +586,58 @@ int main() {
         //Object(glm::vec3(10000, 5000, 0), glm::vec3(0, 0, 15000), 191000000000000000000000000000.0f, 208000000.0f, glm::vec4(1.0f, 0.929f, 0.176f, 1.0f), true),
 
     };
+    if (scenePath && !LoadScene(scenePath)) return 1;
+    if (headless.ticks > 0) {
+        int status = RunHeadless(headless);
+        telemetry::stop();
+        return status;
+    }
+
+    GLFWwindow* window = StartGLU();
+    glstate::Program shaderProgram, sphereProgram;
+    shaderProgram.resolve(CreateShaderProgram(vertexShaderSource, fragmentShaderSource));
+    sphereProgram.resolve(CreateShaderProgram(sphereVertexShaderSource, sphereFragmentShaderSource));
+    glstate::Program impostorProgram;
+    impostorProgram.resolve(CreateShaderProgram(impostorVertexShaderSource, impostorFragmentShaderSource));
+    SphereMesh spheres;
+    CreateSphereMesh(spheres);
+
+    glfwSetKeyCallback(window, keyCallback);
+    glfwSetMouseButtonCallback(window, mouseButtonCallback);
+    glfwSetCursorPosCallback(window, mouse_callback);
+    glfwSetScrollCallback(window, scroll_callback);
+    glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+
+    //projection matrix
+    glm::mat4 projection = glm::perspective(glm::radians(45.0f), 800.0f / 600.0f, 0.1f, 750000.0f);
+    shaderProgram.set("projection", projection);
+    sphereProgram.set("projection", projection);
+    impostorProgram.set("projection", projection);
+    const float pixelsPerUnit = projection[1][1] * 600.0f / 2.0f;   // projected radius per unit of radius / distance
+    if (replayPath) {
+        std::string error;
+        if (!replay.open(replayPath, error)) {
+            std::cerr << error << std::endl;
+            return 1;
+        }
+        replaying = true;
+        // the recording lists everything that is still there
+        for (auto& obj : objs) obj.simulated = true;
+    } else {
+        physics.config.G = G;
+        physics.config.solver = nbody::Solver::Direct;
+        physics.dt = PHYSICS_DT;
+        physics.setPaused(pause);
+        if (recordPath) {
+            if (recorder.open(recordPath, PHYSICS_HZ, RECORD_POSITION_STEP, RECORD_VELOCITY_STEP))
+                physics.onPublish = [](const sim::Snapshot& s) { recorder.push(s); };
+            else
+                std::cerr << "Could not open recording: " << recordPath << std::endl;
+        }
+        for (auto& obj : objs) StartSimulating(obj);
+        physics.start(PHYSICS_HZ);
+    }
+
     float size = 40000.0f;
     int divisions = 50;
     float step = size / divisions;
@@ -227,6 +646,12 @@ int main() {
 
     std::vector<float> gridVertices = CreateGridVertices(size, divisions, objs);
     CreateVBOVAO(gridVAO, gridVBO, gridVertices.data(), gridVertices.size());
+    GridDeformation grid;
+    grid.tree.setTolerance(GRID_TOLERANCE);
+    grid.divisions = divisions;
+    grid.step = step;
+    grid.halfSize = halfSize;
+    grid.originalY = originalY;
 
     while (!glfwWindowShouldClose(window) && running == true) {
         float currentFrame = glfwGetTime();
@@ -235,99 +660,71 @@ int main() {
 
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-        glfwSetKeyCallback(window, keyCallback);
-        glfwSetMouseButtonCallback(window, mouseButtonCallback);
         UpdateCam(shaderProgram, cameraPos);
+        UpdateCam(sphereProgram, cameraPos);
+        UpdateCam(impostorProgram, cameraPos);
         // update objects initializing
         if (!objs.empty() && objs.back().Initalizing) {
             if (glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_RIGHT) == GLFW_PRESS) {
-                objs.back().mass *= 1.0 + 5.0 * deltaTime;
-                std::cout<<"radius: "<<objs.back().radius<<std::endl;
-                
-                // Update vertex data
-                objs.back().UpdateVertices();
+                objs.back().SetMass(objs.back().mass * (1.0 + 5.0 * deltaTime));
+                telemetry::log(radiusEvent, objs.back().radius, objs.back().mass);
             }
         }
 
         // Draw the grid
-        glUseProgram(shaderProgram);
-        glUniform4f(objectColorLoc, 1.0f, 1.0f, 1.0f, 0.25f);
-        glUniform1i(glGetUniformLocation(shaderProgram, "isGrid"), 1);
-        glUniform1i(glGetUniformLocation(shaderProgram, "GLOW"), 0);
-        gridVertices = UpdateGridVertices(gridVertices, objs, halfSize, originalY);
-        glBindBuffer(GL_ARRAY_BUFFER, gridVBO);
-        glBufferData(GL_ARRAY_BUFFER, gridVertices.size() * sizeof(float), gridVertices.data(), GL_DYNAMIC_DRAW);
+        shaderProgram.set("objectColor", glm::vec4(1.0f, 1.0f, 1.0f, 0.25f));
+        shaderProgram.set("isGrid", 1);
+        shaderProgram.set("GLOW", 0);
+        if (UpdateGridVertices(grid, gridVertices, objs)) {
+            glBindBuffer(GL_ARRAY_BUFFER, gridVBO);
+            glBufferSubData(GL_ARRAY_BUFFER, 0, gridVertices.size() * sizeof(float), gridVertices.data());
+        }
         DrawGrid(shaderProgram, gridVAO, gridVertices.size());
-        // Draw the triangles / sphere
+        if (replaying) {
+            ReadReplay(deltaTime);
+        } else {
+            physics.setPaused(pause);
+            ReadPhysics();
+        }
+        // Draw the visible bodies, each at the detail its size on screen needs
+        spheres.candidates.clear();
         for(auto& obj : objs) {
-            glUniform4f(objectColorLoc, obj.color.r, obj.color.g, obj.color.b, obj.color.a);
-
-            for(auto& obj2 : objs){
-                if(&obj2 != &obj && !obj.Initalizing && !obj2.Initalizing && !obj.Launched && !obj2.Launched){
-                    float dx = obj2.GetPos()[0] - obj.GetPos()[0];
-                    float dy = obj2.GetPos()[1] - obj.GetPos()[1];
-                    float dz = obj2.GetPos()[2] - obj.GetPos()[2];
-                    float distance = sqrt(dx * dx + dy * dy + dz * dz);
-
-                    if (distance > 0) {
-                        std::vector<float> direction = {dx / distance, dy / distance, dz / distance};
-                        distance *= 1000;
-                        double Gforce = (G * obj.mass * obj2.mass) / (distance * distance);
-                        
-
-                        float acc1 = Gforce / obj.mass;
-                        std::vector<float> acc = {direction[0] * acc1, direction[1]*acc1, direction[2]*acc1};
-                        if(!pause){
-                            obj.accelerate(acc[0], acc[1], acc[2]);
-                        }
-
-                        //collision
-                        obj.velocity *= obj.CheckCollision(obj2);
-                    }
-                }
-            }
             if(obj.Initalizing){
-                obj.radius = pow(((3 * obj.mass/obj.density)/(4 * 3.14159265359)), (1.0f/3.0f)) / sizeRatio;
-                obj.UpdateVertices();
                 obj.glow = true;
             }
 
             if(obj.Launched){
                 obj.Launched = false;
+                StartSimulating(obj);
             }
-
-            //update positions
-            if(!pause){
-                obj.UpdatePos();
-            }
-            
-            glm::mat4 model = glm::mat4(1.0f);
-            model = glm::translate(model, obj.position); // Apply position here
-            glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-            glUniform1i(glGetUniformLocation(shaderProgram, "isGrid"), 0);
-            if(obj.glow){
-                glUniform1i(glGetUniformLocation(shaderProgram, "GLOW"), 1);
-            } else {
-                glUniform1i(glGetUniformLocation(shaderProgram, "GLOW"), 0);
-            }
-            
-            glBindVertexArray(obj.VAO);
-            glDrawArrays(GL_TRIANGLES, 0, obj.vertexCount / 3);
+            spheres.candidates.push_back({ glm::vec4(obj.position, obj.radius), obj.color, obj.glow ? 1.0f : 0.0f });
+        }
+        size_t visible = CullSpheres(spheres, projection * ViewMatrix(cameraPos), cameraPos, pixelsPerUnit);
+        telemetry::log(sphereEvent, double(visible), double(spheres.candidates.size()));
+        if (visible > 0) {
+            glstate::state().useProgram(impostors ? impostorProgram.id : sphereProgram.id);
+            DrawSpheres(spheres, impostors);
         }
-        
+
         glfwSwapBuffers(window);
         glfwPollEvents();
+        glstate::Stats glCalls = glstate::state().endFrame();
+        telemetry::log(glEvent, glCalls.issued, glCalls.elided);
     }
 
-    for (auto& obj : objs) {
-        glDeleteVertexArrays(1, &obj.VAO);
-        glDeleteBuffers(1, &obj.VBO);
-    }
+    DestroySphereMesh(spheres);
 
     glDeleteVertexArrays(1, &gridVAO);
     glDeleteBuffers(1, &gridVBO);
 
-    glDeleteProgram(shaderProgram);
+    physics.stop();
+    recorder.close();
+    if (recorder.droppedFrames())
+        std::cerr << "Recording dropped " << recorder.droppedFrames() << " ticks" << std::endl;
+    telemetry::stop();
+    glDeleteProgram(shaderProgram.id);
+    glDeleteProgram(sphereProgram.id);
+    glDeleteProgram(impostorProgram.id);
     glfwTerminate();
 
     glfwTerminate();
@@ -354,10 +751,11 @@ GLFWwindow* StartGLU() {
         return nullptr;
     }
 
-    glEnable(GL_DEPTH_TEST);
+    glstate::state().enable(GL_DEPTH_TEST);
     glViewport(0, 0, 800, 600);
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA); // Standard blending for transparency
+    glstate::state().enable(GL_BLEND);
+    glstate::state().blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA); // Standard blending for transparency
+    glPointSize(5.0f);
 
     return window;
 }
@@ -410,20 +808,172 @@ void CreateVBOVAO(GLuint& VAO, GLuint& VBO, const float* vertices, size_t vertex
     glGenVertexArrays(1, &VAO);
     glGenBuffers(1, &VBO);
 
-    glBindVertexArray(VAO);
+    glstate::state().bindVertexArray(VAO);
     glBindBuffer(GL_ARRAY_BUFFER, VBO);
     glBufferData(GL_ARRAY_BUFFER, vertexCount * sizeof(float), vertices, GL_STATIC_DRAW);
 
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
     glEnableVertexAttribArray(0);
-    glBindVertexArray(0);
 }
 
-void UpdateCam(GLuint shaderProgram, glm::vec3 cameraPos) {
-    glUseProgram(shaderProgram);
-    glm::mat4 view = glm::lookAt(cameraPos, cameraPos + cameraFront, cameraUp);
-    GLint viewLoc = glGetUniformLocation(shaderProgram, "view");
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
+// Attributes 1-3 of the bound VAO from instance first on, one step per instance
+void BindInstanceAttributes(const SphereMesh& mesh, size_t first) {
+    const size_t base = first * sizeof(SphereInstance);
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.instanceVBO);
+    glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, sizeof(SphereInstance), (void*)(base + offsetof(SphereInstance, posRadius)));
+    glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, sizeof(SphereInstance), (void*)(base + offsetof(SphereInstance, color)));
+    glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, sizeof(SphereInstance), (void*)(base + offsetof(SphereInstance, glow)));
+    for (GLuint a = 1; a <= 3; ++a) {
+        glEnableVertexAttribArray(a);
+        glVertexAttribDivisor(a, 1);
+    }
+}
+
+// Each level is a unit sphere of (segments + 1)^2 shared vertices and two
+// triangles per quad; the seam column is duplicated so indices stay simple
+void CreateSphereMesh(SphereMesh& mesh) {
+    std::vector<float> vertices;
+    std::vector<GLuint> indices;
+    for (int l = 0; l < SPHERE_LODS; ++l) {
+        const int n = SPHERE_LOD_SEGMENTS[l];
+        SphereMesh::Lod& lod = mesh.lods[l];
+        lod.firstIndex = GLuint(indices.size());
+        lod.baseVertex = GLint(vertices.size() / 3);
+        lod.maxPixels = l == 0 ? INFINITY : SPHERE_LOD_ERROR / (1.0f - std::cos(glm::pi<float>() / n));
+        for (int i = 0; i <= n; ++i) {
+            float theta = float(i) / n * glm::pi<float>();
+            for (int j = 0; j <= n; ++j) {
+                float phi = float(j) / n * 2 * glm::pi<float>();
+                glm::vec3 v = sphericalToCartesian(1.0f, theta, phi);
+                vertices.insert(vertices.end(), {v.x, v.y, v.z});
+            }
+        }
+        for (int i = 0; i < n; ++i) {
+            for (int j = 0; j < n; ++j) {
+                GLuint v1 = i * (n + 1) + j, v2 = v1 + 1;
+                GLuint v3 = v1 + (n + 1), v4 = v3 + 1;
+                indices.insert(indices.end(), {v1, v2, v3, v2, v4, v3});
+            }
+        }
+        lod.indexCount = GLsizei(indices.size() - lod.firstIndex);
+    }
+
+    CreateVBOVAO(mesh.VAO, mesh.VBO, vertices.data(), vertices.size());
+    glGenBuffers(1, &mesh.EBO);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.EBO);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint), indices.data(), GL_STATIC_DRAW);
+
+    // attributes 1-3 advance once per instance
+    glGenBuffers(1, &mesh.instanceVBO);
+    BindInstanceAttributes(mesh, 0);
+
+    // impostor quad as a triangle strip
+    const float corners[] = { -1.0f, -1.0f,  1.0f, -1.0f,  -1.0f, 1.0f,  1.0f, 1.0f };
+    glGenVertexArrays(1, &mesh.impostorVAO);
+    glGenBuffers(1, &mesh.impostorVBO);
+    glstate::state().bindVertexArray(mesh.impostorVAO);
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.impostorVBO);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), (void*)0);
+    glEnableVertexAttribArray(0);
+    BindInstanceAttributes(mesh, 0);
+
+    mesh.multiDraw = GLEW_VERSION_4_3 || (GLEW_ARB_multi_draw_indirect && GLEW_ARB_base_instance);
+    if (mesh.multiDraw) glGenBuffers(1, &mesh.indirectBuffer);
+}
+void DestroySphereMesh(SphereMesh& mesh) {
+    glDeleteVertexArrays(1, &mesh.VAO);
+    glDeleteBuffers(1, &mesh.VBO);
+    glDeleteBuffers(1, &mesh.EBO);
+    glDeleteBuffers(1, &mesh.instanceVBO);
+    glDeleteVertexArrays(1, &mesh.impostorVAO);
+    glDeleteBuffers(1, &mesh.impostorVBO);
+    if (mesh.indirectBuffer) glDeleteBuffers(1, &mesh.indirectBuffer);
+}
+
+size_t CullSpheres(SphereMesh& mesh, const glm::mat4& viewProj, glm::vec3 eye, float pixelsPerUnit) {
+    // frustum planes (Gribb-Hartmann), normalised so distances are in scene units
+    glm::vec4 planes[6];
+    for (int a = 0; a < 3; ++a) {
+        glm::vec4 row(viewProj[0][a], viewProj[1][a], viewProj[2][a], viewProj[3][a]);
+        glm::vec4 w(viewProj[0][3], viewProj[1][3], viewProj[2][3], viewProj[3][3]);
+        planes[2 * a] = w + row;
+        planes[2 * a + 1] = w - row;
+    }
+    for (auto& p : planes) p /= glm::length(glm::vec3(p));
+
+    const int n = int(mesh.candidates.size());
+    mesh.lodOf.resize(n);
+    NBODY_OMP(omp parallel for schedule(static))
+    for (int i = 0; i < n; ++i) {
+        const glm::vec4& s = mesh.candidates[i].posRadius;
+        int lod = 0;
+        for (const auto& p : planes) {
+            if (glm::dot(glm::vec3(p), glm::vec3(s)) + p.w < -s.w) { lod = -1; break; }
+        }
+        if (lod == 0) {
+            float distance = glm::length(glm::vec3(s) - eye);
+            float pixels = distance > s.w ? s.w * pixelsPerUnit / distance : INFINITY;
+            lod = SPHERE_LODS - 1;
+            while (lod > 0 && pixels > mesh.lods[lod].maxPixels) --lod;
+        }
+        mesh.lodOf[i] = lod;
+    }
+
+    // group the visible instances by level
+    for (int l = 0; l < SPHERE_LODS; ++l) mesh.lodCount[l] = 0;
+    for (int i = 0; i < n; ++i)
+        if (mesh.lodOf[i] >= 0) mesh.lodCount[mesh.lodOf[i]]++;
+    GLuint visible = 0;
+    for (int l = 0; l < SPHERE_LODS; ++l) {
+        mesh.lodFirst[l] = visible;
+        visible += mesh.lodCount[l];
+    }
+    mesh.instances.resize(visible);
+    GLuint next[SPHERE_LODS];
+    std::copy(mesh.lodFirst, mesh.lodFirst + SPHERE_LODS, next);
+    for (int i = 0; i < n; ++i)
+        if (mesh.lodOf[i] >= 0) mesh.instances[next[mesh.lodOf[i]]++] = mesh.candidates[i];
+    return visible;
+}
+
+void DrawSpheres(SphereMesh& mesh, bool impostors) {
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.instanceVBO);
+    glBufferData(GL_ARRAY_BUFFER, mesh.instances.size() * sizeof(SphereInstance), mesh.instances.data(), GL_STREAM_DRAW);
+    if (impostors) {
+        glstate::state().bindVertexArray(mesh.impostorVAO);
+        glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, GLsizei(mesh.instances.size()));
+        return;
+    }
+    glstate::state().bindVertexArray(mesh.VAO);
+
+    if (mesh.multiDraw) {
+        DrawElementsIndirectCommand commands[SPHERE_LODS];
+        for (int l = 0; l < SPHERE_LODS; ++l) {
+            const SphereMesh::Lod& lod = mesh.lods[l];
+            commands[l] = { GLuint(lod.indexCount), mesh.lodCount[l], lod.firstIndex, lod.baseVertex, mesh.lodFirst[l] };
+        }
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, mesh.indirectBuffer);
+        glBufferData(GL_DRAW_INDIRECT_BUFFER, sizeof(commands), commands, GL_STREAM_DRAW);
+        glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, nullptr, SPHERE_LODS, 0);
+        return;
+    }
+    // without base instances, point the instance attributes at each level's range
+    for (int l = 0; l < SPHERE_LODS; ++l) {
+        if (mesh.lodCount[l] == 0) continue;
+        const SphereMesh::Lod& lod = mesh.lods[l];
+        BindInstanceAttributes(mesh, mesh.lodFirst[l]);
+        glDrawElementsInstancedBaseVertex(GL_TRIANGLES, lod.indexCount, GL_UNSIGNED_INT,
+                                          (void*)(lod.firstIndex * sizeof(GLuint)), GLsizei(mesh.lodCount[l]), lod.baseVertex);
+    }
+}
+
+glm::mat4 ViewMatrix(glm::vec3 cameraPos) {
+    return glm::lookAt(cameraPos, cameraPos + cameraFront, cameraUp);
+}
+
+void UpdateCam(glstate::Program& program, glm::vec3 cameraPos) {
+    program.set("view", ViewMatrix(cameraPos));
 }
 
 void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods) {
@@ -466,7 +1016,19 @@ void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods
         running = false;
     }
 
+    if (key == GLFW_KEY_I && action == GLFW_PRESS){
+        impostors = !impostors;
+        std::cout<<"SPHERES: "<<(impostors ? "impostors" : "meshes")<<std::endl;
+    }
+
+    if (key == GLFW_KEY_B && action == GLFW_PRESS){
+        physics.config.solver = nbody::nextSolver(physics.config.solver);
+        physics.setSolver(physics.config.solver);
+        std::cout<<"SOLVER: "<<nbody::solverName(physics.config.solver)<<std::endl;
+    }
+
     if (glfwGetKey(window, GLFW_KEY_X) == GLFW_PRESS){
+        if (!objs.empty() && objs.back().simulated) physics.remove(objs.back().id);
         objs.pop_back();
         std::cout<<"DELETE"<<std::endl;
     }
@@ -534,8 +1096,8 @@ void mouseButtonCallback(GLFWwindow* window, int button, int action, int mods){
     };
     if (!objs.empty() && button == GLFW_MOUSE_BUTTON_RIGHT && objs[objs.size()-1].Initalizing) {
         if (action == GLFW_PRESS || action == GLFW_REPEAT) {
-            objs[objs.size()-1].mass *= 1.2;}
-            std::cout<<"MASS: "<<objs[objs.size()-1].mass<<std::endl;
+            objs[objs.size()-1].SetMass(objs[objs.size()-1].mass * 1.2f);}
+            telemetry::log(massEvent, objs[objs.size()-1].mass);
     }
 };
 void scroll_callback(GLFWwindow* window, double xoffset, double yoffset){
@@ -553,16 +1115,12 @@ glm::vec3 sphericalToCartesian(float r, float theta, float phi){
     float z = r * sin(theta) * sin(phi);
     return glm::vec3(x, y, z);
 };
-void DrawGrid(GLuint shaderProgram, GLuint gridVAO, size_t vertexCount) {
-    glUseProgram(shaderProgram);
-    glm::mat4 model = glm::mat4(1.0f); // Identity matrix for the grid
-    GLint modelLoc = glGetUniformLocation(shaderProgram, "model");
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
+void DrawGrid(glstate::Program& program, GLuint gridVAO, size_t vertexCount) {
+    glstate::state().useProgram(program.id);
+    program.set("model", glm::mat4(1.0f)); // Identity matrix for the grid
 
-    glBindVertexArray(gridVAO);
-    glPointSize(5.0f);
+    glstate::state().bindVertexArray(gridVAO);
     glDrawArrays(GL_LINES, 0, vertexCount / 3);
-    glBindVertexArray(0);
 }
 std::vector<float> CreateGridVertices(float size, int divisions, const std::vector<Object>& objs) {
     
@@ -602,89 +1160,67 @@ std::vector<float> CreateGridVertices(float size, int divisions, const std::vect
     return vertices;
 
 }
-std::vector<float> UpdateGridVertices(std::vector<float> vertices, const std::vector<Object>& objs, float halfSize, float originalY) {
-
-    glm::vec3 cornerLL(-halfSize, originalY, -halfSize); 
-    float dy_LL = 0.0f;
-    for (const auto& obj : objs) {
-        glm::vec3 toObject = obj.GetPos() - cornerLL;
-        float distance = glm::length(toObject);
-        float distance_m = distance * 1000.0f;
-        float rs = (2 * G * obj.mass) / (c * c);
-        if (distance_m > rs) {
-            float dz = 2 * std::sqrt(rs * (distance_m - rs));
-            dy_LL += dz * 2.0f;
+bool UpdateGridVertices(GridDeformation& grid, std::vector<float>& vertices, const std::vector<Object>& objs) {
+    const int n = grid.divisions + 1;
+    const size_t vertexCount = vertices.size() / 3;
+    bool changed = grid.lastBodies.size() != objs.size() || grid.vertexLattice.size() != vertexCount;
+    for (size_t i = 0; i < objs.size() && !changed; ++i)
+        changed = grid.lastBodies[i] != glm::vec4(objs[i].position, objs[i].mass);
+    if (!changed) return false;
+    grid.lastBodies.resize(objs.size());
+    for (size_t i = 0; i < objs.size(); ++i) grid.lastBodies[i] = glm::vec4(objs[i].position, objs[i].mass);
+
+    if (grid.vertexLattice.size() != vertexCount) {
+        grid.vertexLattice.resize(vertexCount);
+        for (size_t v = 0; v < vertexCount; ++v) {
+            int ix = int(std::lround((vertices[3 * v] + grid.halfSize) / grid.step));
+            int iz = int(std::lround((vertices[3 * v + 2] + grid.halfSize) / grid.step));
+            grid.vertexLattice[v] = iz * n + ix;
         }
+        grid.height.resize(size_t(n) * n);
     }
 
-    glm::vec3 cornerLR(halfSize, originalY, -halfSize); 
-    float dy_LR = 0.0f;
-    for (const auto& obj : objs) {
-        glm::vec3 toObject = obj.GetPos() - cornerLR;
-        float distance = glm::length(toObject);
-        float distance_m = distance * 1000.0f;
-        float rs = (2 * G * obj.mass) / (c * c);
-        if (distance_m > rs) {
-            float dz = 2 * std::sqrt(rs * (distance_m - rs));
-            dy_LR += dz * 2.0f;
-        }
+    // tree over the bodies, in metres like rs (scene units are km)
+    const size_t count = objs.size();
+    grid.bx.resize(count); grid.by.resize(count); grid.bz.resize(count); grid.rs.resize(count);
+    for (size_t i = 0; i < count; ++i) {
+        grid.bx[i] = objs[i].position.x * 1000.0f;
+        grid.by[i] = objs[i].position.y * 1000.0f;
+        grid.bz[i] = objs[i].position.z * 1000.0f;
+        grid.rs[i] = float((2 * G * objs[i].mass) / (c * c));
     }
-
-    glm::vec3 cornerUL(-halfSize, originalY, halfSize); 
-    float dy_UL = 0.0f;
-    for (const auto& obj : objs) {
-        glm::vec3 toObject = obj.GetPos() - cornerUL;
-        float distance = glm::length(toObject);
-        float distance_m = distance * 1000.0f;
-        float rs = (2 * G * obj.mass) / (c * c);
-        if (distance_m > rs) {
-            float dz = 2 * std::sqrt(rs * (distance_m - rs));
-            dy_UL += dz * 2.0f;
-        }
+    grid.tree.build(grid.bx.data(), grid.by.data(), grid.bz.data(), grid.rs.data(), count);
+
+    // deflection of every lattice point
+    const wells::Tree& tree = grid.tree;
+    NBODY_OMP(omp parallel for schedule(static))
+    for (int p = 0; p < n * n; ++p) {
+        const float x = (-grid.halfSize + (p % n) * grid.step) * 1000.0f;
+        const float y = grid.originalY * 1000.0f;
+        const float z = (-grid.halfSize + (p / n) * grid.step) * 1000.0f;
+        grid.height[p] = 4.0f * tree.sum(x, y, z,
+            [](const wells::Node& node, float r) { return node.weight * std::sqrt(r - node.shift); },
+            [&](int k) {
+                float dx = tree.x[k] - x, dy = tree.y[k] - y, dz = tree.z[k] - z;
+                float distance_m = std::sqrt(dx * dx + dy * dy + dz * dz);
+                return std::sqrt(tree.rs[k] * std::max(distance_m - tree.rs[k], 0.0f));
+            });
     }
 
-    glm::vec3 cornerUR(halfSize, originalY, halfSize); 
-    float dy_UR = 0.0f;
-    for (const auto& obj : objs) {
-        glm::vec3 toObject = obj.GetPos() - cornerUR;
-        float distance = glm::length(toObject);
-        float distance_m = distance * 1000.0f;
-        float rs = (2 * G * obj.mass) / (c * c);
-        if (distance_m > rs) {
-            float dz = 2 * std::sqrt(rs * (distance_m - rs));
-            dy_UR += dz * 2.0f;
-        }
-    }
-
-    for (size_t i = 0; i < vertices.size(); i += 3) {
-        float x = vertices[i];
-        float z = vertices[i + 2];
-
-        glm::vec3 vertexPos(x, originalY, z);
-        float dy = 0.0f;
-        for (const auto& obj : objs) {
-            glm::vec3 toObject = obj.GetPos() - vertexPos;
-            float distance = glm::length(toObject);
-            float distance_m = distance * 1000.0f;
-            float rs = (2 * G * obj.mass) / (c * c);
-            if (distance_m > rs) {
-                float dz = 2 * std::sqrt(rs * (distance_m - rs));
-                dy += dz * 2.0f;
-            }
-        }
-
-        float u = (x + halfSize) / (2 * halfSize); 
-        float v = (z + halfSize) / (2 * halfSize);
-
+    // tilt back by the bilinear blend of the corner deflections
+    const float dy_LL = grid.height[0], dy_LR = grid.height[n - 1];
+    const float dy_UL = grid.height[(n - 1) * n], dy_UR = grid.height[n * n - 1];
+    for (int p = 0; p < n * n; ++p) {
+        float u = float(p % n) / grid.divisions;
+        float v = float(p / n) / grid.divisions;
         float shift = (1 - u) * (1 - v) * dy_LL +  // Lower-left contribution
                       u * (1 - v) * dy_LR +        // Lower-right
                       (1 - u) * v * dy_UL +        // Upper-left
                       u * v * dy_UR;               // Upper-right
-
-        vertices[i + 1] = originalY + (dy - shift) + halfSize / 3;
+        grid.height[p] = grid.originalY + (grid.height[p] - shift) + grid.halfSize / 3;
     }
-
-    return vertices;
+    for (size_t v = 0; v < vertexCount; ++v) vertices[3 * v + 1] = grid.height[grid.vertexLattice[v]];
+    return true;
 }
 
 
@@ -4,6 +4,8 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include <vector>
+#include <unordered_map>
+#include <unordered_set>
 #include <iostream>
 #define _USE_MATH_DEFINES
 #include <cmath>
@@ -13,6 +15,13 @@
 #include <chrono>
 #include <fstream>
 #include <sstream>
+#include "gl_state.h"
+#include "nbody.h"
+#include "recording.h"
+#include "sim_thread.h"
+#include "scene.h"
+#include "telemetry.h"
+#include "well_tree.h"
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
 #endif
@@ -27,6 +36,8 @@ double c = 299792458.0;
 double G = 6.67430e-11;
 struct Ray;
 bool Gravity = false;
+nbody::Solver GravitySolver = nbody::Solver::Direct;
+extern bool ShowHud;
 
 struct Camera {
     // Center the camera orbit on the black hole at (0, 0, 0)
@@ -115,6 +126,13 @@ struct Camera {
             Gravity = !Gravity;
             cout << "[INFO] Gravity turned " << (Gravity ? "ON" : "OFF") << endl;
         }
+        if (action == GLFW_PRESS && key == GLFW_KEY_H) {
+            ShowHud = !ShowHud;
+        }
+        if (action == GLFW_PRESS && key == GLFW_KEY_B) {
+            GravitySolver = nbody::nextSolver(GravitySolver);
+            cout << "[INFO] Gravity solver: " << nbody::solverName(GravitySolver) << endl;
+        }
     }
 };
 Camera camera;
@@ -135,6 +153,12 @@ struct BlackHole {
     }
 };
 BlackHole SagA(vec3(0.0f, 0.0f, 0.0f), 8.54e36); // Sagittarius A black hole
+
+// -- Geometrized units -- //
+// The tracer integrates in units of SagA's Schwarzschild radius (r_s = 1);
+// camera and scene data are converted when uploaded.
+inline float toGeom(double metres) { return float(metres / SagA.r_s); }
+inline vec3 toGeom(const vec3& metres) { return vec3(dvec3(metres) / SagA.r_s); }
 struct ObjectData {
     vec4 posRadius; // xyz = position, w = radius
     vec4 color;     // rgb = color, a = unused
@@ -150,23 +174,288 @@ vector<ObjectData> objects = {
     //{ vec4(6e10f, 0.0f, 0.0f, 5e10f), vec4(0,1,0,1), <mass>, vec3(0,0,0) }
 };
 
+// -- N-body integrator -- //
+// Fixed-step kick-drift-kick leapfrog from nbody.h on its own thread at
+// PHYSICS_HZ ticks per second, one DT step per tick, so simulated time runs
+// at 60 s per real second whatever the frame rate. G pauses it and B
+// switches the solver (direct sum, Barnes-Hut or FMM). The render loop
+// copies the latest snapshot, interpolated between ticks, into objects.
+const double PHYSICS_HZ = 60.0;
+const double PHYSICS_DT = 1.0;   // simulated seconds per step
+sim::PhysicsThread physics;
+sim::Snapshot physicsView;       // render-thread copy of the blended snapshot
+
+// Bodies come straight from the scene file's columns when one is loaded
+void startPhysics(const vector<ObjectData>& objs, const scene::File* file) {
+    physics.config.G = G;
+    physics.config.softening = 1e10;   // m, ~r_s of SagA; keeps plunging bodies finite
+    physics.config.solver = GravitySolver;
+    physics.dt = PHYSICS_DT;
+    physics.stepsPerTick = 1;
+    physics.setPaused(!Gravity);
+    nbody::Bodies bodies;
+    if (file) {
+        file->copyTo(bodies);
+    } else {
+        bodies.resize(objs.size());
+        for (size_t i = 0; i < objs.size(); ++i) {
+            bodies.x[i] = objs[i].posRadius.x;  bodies.y[i] = objs[i].posRadius.y;  bodies.z[i] = objs[i].posRadius.z;
+            bodies.vx[i] = objs[i].velocity.x;  bodies.vy[i] = objs[i].velocity.y;  bodies.vz[i] = objs[i].velocity.z;
+            bodies.m[i] = objs[i].mass;
+        }
+    }
+    physics.load(bodies);
+    physics.start(PHYSICS_HZ);
+}
+// Body ids are indices into objs
+void applySnapshot(vector<ObjectData>& objs, const sim::Snapshot& s) {
+    for (size_t k = 0; k < s.id.size(); ++k) {
+        if (s.id[k] >= objs.size()) continue;   // a replay of some other scene
+        ObjectData& o = objs[s.id[k]];
+        o.posRadius.x = float(s.x[k]);  o.posRadius.y = float(s.y[k]);  o.posRadius.z = float(s.z[k]);
+        o.velocity = vec3(s.vx[k], s.vy[k], s.vz[k]);
+    }
+}
+void readPhysics(vector<ObjectData>& objs, double now) {
+    physics.poll();
+    physics.blend(now, physicsView);
+    applySnapshot(objs, physicsView);
+}
+
+// -- Recording and replay -- //
+// --record <file> writes every physics tick to a recording (recording.h);
+// --replay <file> plays one back instead of running the physics, at the
+// rate it was recorded, looping at the end. Replay only moves bodies, so
+// pass the --scene the recording was made with to get the same objects and
+// colours. G pauses the replay like it pauses the simulation.
+const double RECORD_POSITION_STEP = 1e4;     // m; scene scales are ~1e11 m
+const double RECORD_VELOCITY_STEP = 1e-3;    // m/s
+recording::Writer recorder;
+recording::Reader replay;
+bool replaying = false;
+double replayTicks = 0.0;        // ticks played since the first frame
+
+void readReplay(vector<ObjectData>& objs, double dt) {
+    if (Gravity) replayTicks += dt * replay.header().ticksPerSecond;
+    uint64_t tick = replay.firstTick() + uint64_t(replayTicks);
+    if (tick > replay.lastTick()) {
+        replayTicks = 0.0;
+        tick = replay.firstTick();
+    }
+    if (replay.frameAt(tick, physicsView)) applySnapshot(objs, physicsView);
+}
+
+// -- Scene files -- //
+// --scene <file> replaces the built-in objects, and the black hole and
+// camera when the file sets them, with a binary scene (format in scene.h,
+// written by scene_convert). The camera keeps orbiting the origin, so only
+// the camera position's distance and direction are used.
+scene::File sceneFile;
+bool loadScene(const char* path) {
+    string error;
+    if (!sceneFile.open(path, error)) {
+        cerr << "[ERROR] " << error << endl;
+        return false;
+    }
+    const scene::Header& h = sceneFile.header();
+    if (h.flags & scene::HAS_BLACK_HOLE) {
+        const double* p = h.blackHolePosition;
+        SagA = BlackHole(vec3(p[0], p[1], p[2]), float(h.blackHoleMass));
+    }
+    if (h.flags & scene::HAS_CAMERA) {
+        dvec3 d = dvec3(h.cameraPosition[0], h.cameraPosition[1], h.cameraPosition[2]);
+        double r = length(d);
+        if (r > 0.0) {
+            camera.radius = glm::clamp(float(r), camera.minRadius, camera.maxRadius);
+            camera.elevation = float(acos(d.y / r));
+            camera.azimuth = float(atan2(d.z, d.x));
+        }
+    }
+    const size_t n = sceneFile.size();
+    const double* x = sceneFile.column(scene::X);
+    const double* y = sceneFile.column(scene::Y);
+    const double* z = sceneFile.column(scene::Z);
+    const double* vx = sceneFile.column(scene::VX);
+    const double* vy = sceneFile.column(scene::VY);
+    const double* vz = sceneFile.column(scene::VZ);
+    const double* mass = sceneFile.column(scene::MASS);
+    const double* radius = sceneFile.column(scene::RADIUS);
+    const float* rgba = sceneFile.color();
+    objects.clear();
+    objects.reserve(n);
+    for (size_t i = 0; i < n; ++i) {
+        objects.emplace_back(vec4(x[i], y[i], z[i], radius[i]), vec4(rgba[4 * i], rgba[4 * i + 1], rgba[4 * i + 2], rgba[4 * i + 3]),
+                             float(mass[i]), vec3(vx[i], vy[i], vz[i]));
+    }
+    cout << "[INFO] Loaded " << n << " bodies from " << path << endl;
+    return true;
+}
+
+// Triple-buffered ring for uniform blocks. Every frame uses its own slot of
+// one buffer (persistently mapped on GL 4.4+), a fence per slot tells us when
+// the GPU has finished reading it, and each block keeps a CPU shadow copy so
+// unchanged data is never written again.
+struct UniformRing {
+    static const int SLOTS = 3;
+    struct Block {
+        GLuint binding;
+        GLsizeiptr size;
+        GLintptr offset;                // offset inside a slot
+        vector<unsigned char> shadow;   // last data handed to write()
+        unsigned version = 1;           // bumped whenever shadow changes
+        unsigned slotVersion[SLOTS] = {}; // version stored in each slot
+    };
+    vector<Block> blocks;
+    GLuint buffer = 0;
+    GLsizeiptr slotStride = 0;
+    unsigned char* mapped = nullptr;    // null -> glBufferSubData fallback
+    GLsync fences[SLOTS] = {};
+    int slot = 0;
+    int stalls = 0;                     // frames that had to wait on a fence
+
+    int addBlock(GLuint binding, GLsizeiptr size) {
+        Block b;
+        b.binding = binding;
+        b.size = size;
+        b.offset = 0;
+        b.shadow.assign(size, 0);
+        blocks.push_back(b);
+        return int(blocks.size()) - 1;
+    }
+    // Lay out the blocks in a slot and allocate SLOTS copies of it
+    void create() {
+        GLint align = 256;
+        glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &align);
+        auto alignUp = [&](GLsizeiptr v) { return (v + align - 1) / align * align; };
+        slotStride = 0;
+        for (auto& b : blocks) {
+            b.offset = slotStride;
+            slotStride = alignUp(slotStride + b.size);
+        }
+        glGenBuffers(1, &buffer);
+        glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+        if (GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage) {
+            GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glBufferStorage(GL_UNIFORM_BUFFER, slotStride * SLOTS, nullptr, flags);
+            mapped = static_cast<unsigned char*>(glMapBufferRange(GL_UNIFORM_BUFFER, 0, slotStride * SLOTS, flags));
+        }
+        if (!mapped) {
+            glBufferData(GL_UNIFORM_BUFFER, slotStride * SLOTS, nullptr, GL_DYNAMIC_DRAW);
+        }
+    }
+    // Stage new contents for a block; returns false if nothing changed
+    bool write(int block, const void* data) {
+        Block& b = blocks[block];
+        if (std::memcmp(b.shadow.data(), data, b.size) == 0) return false;
+        std::memcpy(b.shadow.data(), data, b.size);
+        b.version++;
+        return true;
+    }
+    // Move to the next slot, refresh only the blocks that slot holds stale
+    // copies of, and bind every block's range. With three slots the fence
+    // is almost always signalled already, so the wait is only a safety net.
+    void commit() {
+        slot = (slot + 1) % SLOTS;
+        bool stale = false;
+        for (const auto& b : blocks) stale |= b.slotVersion[slot] != b.version;
+        if (stale && fences[slot]) {
+            if (glClientWaitSync(fences[slot], 0, 0) == GL_TIMEOUT_EXPIRED) {
+                stalls++;
+                glClientWaitSync(fences[slot], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000ull);
+            }
+        }
+        if (fences[slot]) {
+            glDeleteSync(fences[slot]);
+            fences[slot] = 0;
+        }
+        glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+        for (auto& b : blocks) {
+            GLintptr offset = slot * slotStride + b.offset;
+            if (b.slotVersion[slot] != b.version) {
+                if (mapped) std::memcpy(mapped + offset, b.shadow.data(), b.size);
+                else glBufferSubData(GL_UNIFORM_BUFFER, offset, b.size, b.shadow.data());
+                b.slotVersion[slot] = b.version;
+            }
+            glBindBufferRange(GL_UNIFORM_BUFFER, b.binding, buffer, offset, b.size);
+        }
+    }
+    // Fence the slot once the commands that read it have been issued
+    void endFrame() {
+        fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+};
+
 struct Engine {
-    GLuint gridShaderProgram;
+    glstate::Program gridShaderProgram;
     // -- Quad & Texture render -- //
     GLFWwindow* window;
     GLuint quadVAO;
     GLuint texture;
-    GLuint shaderProgram;
+    glstate::Program shaderProgram;
+    // -- temporal accumulation -- //
+    static const int MAX_SAMPLES = 64;  // still frames stop tracing after this many
+    GLuint historyTexture = 0;          // rgba16f running average
+    int traceWidth = 0, traceHeight = 0;
+    int sampleCount = 0;
+    unsigned char lastPose[128] = {};
     GLuint computeProgram = 0;
-    // -- UBOs -- //
-    GLuint cameraUBO = 0;
-    GLuint diskUBO = 0;
-    GLuint objectsUBO = 0;
+    // -- UBOs (slices of one triple-buffered ring) -- //
+    UniformRing uniforms;
+    int cameraBlock = -1;
+    int diskBlock = -1;
+    // -- object SSBOs (std430, no fixed cap) -- //
+    GLuint objectsSSBO = 0;
+    GLuint objectGridSSBO = 0;
+    GLuint objectCellsSSBO = 0;
+    GLsizeiptr objectsSSBOSize = 0, objectGridSSBOSize = 0, objectCellsSSBOSize = 0;
+    bool objectsUploaded = false;
     // -- grid mess vars -- //
     GLuint gridVAO = 0;
     GLuint gridVBO = 0;
     GLuint gridEBO = 0;
     int gridIndexCount = 0;
+    GLuint gridWellsTBO = 0;          // texture buffer read by grid.vert
+    GLuint gridWellsTexture = 0;
+    vector<vec4> gridWells;           // xyz = position, w = r_s
+    vector<vec4> lastGridWells;
+    wells::Tree gridTree;             // over the wells' xz, see well_tree.h
+    vector<float> wellX, wellZ, wellRs;
+    vector<vec4> gridTreeTexels;      // two per node for grid.vert
+    vector<vec4> gridTreeWells;       // wells in tree order
+    GLuint gridTreeTBO = 0;
+    GLuint gridTreeTexture = 0;
+    bool gridWellsUploaded = false;
+    vec2 gridHeightRange = vec2(0.0f);
+    vec3 gridCamPos = vec3(0.0f);     // camera position the quadtree was built for
+    vector<vec4> meshWells;           // wells the quadtree was built for
+    vector<float> meshWellSlack;      // xz distance each may move before it is rebuilt
+    vector<vec3> lodVertices, uploadedVertices;
+    vector<GLuint> lodIndices, uploadedIndices;
+    unordered_map<uint32_t, GLuint> lodVertexIds;
+    unordered_set<uint64_t> lodEdges;
+
+    // Packed std430 mirror of ObjectData, must match SceneObject in geodesic.comp
+    struct GPUObject {
+        vec4 posRadius;
+        vec4 color;
+        float mass;
+        float _pad0, _pad1, _pad2;
+    };
+    // Header of the ObjectGrid SSBO, cellStart[] follows it
+    struct GPUObjectGrid {
+        vec4 gridMin;      // xyz = world-space min corner
+        vec4 gridInvCell;  // xyz = 1 / cell size
+        int  gridDims[4];  // xyz = cell counts
+    };
+    static_assert(sizeof(GPUObject) == 48, "SceneObject is 48 bytes in std430");
+    // CPU scratch for the object SSBOs, reused between uploads
+    vector<GPUObject> gpuObjects;
+    vector<char> packedObjects;
+    vector<char> lastPackedObjects;
+    vector<char> packedGrid;
+    vector<GLuint> cellStart;
+    vector<GLuint> cellObjects;
+    vector<GLuint> cellFill;
 
     int WIDTH = 800;  // Window width
     int HEIGHT = 600; // Window height
@@ -209,136 +498,281 @@ struct Engine {
             exit(EXIT_FAILURE);
         }
         cout << "OpenGL " << glGetString(GL_VERSION) << "\n";
-        this->shaderProgram = CreateShaderProgram();
-        gridShaderProgram = CreateShaderProgram("shaders/grid.vert", "shaders/grid.frag");
-
-        // computeProgram = CreateComputeProgram("shaders/geodesic.comp"); // Disabled for macOS compatibility
-        glGenBuffers(1, &cameraUBO);
-        glBindBuffer(GL_UNIFORM_BUFFER, cameraUBO);
-        glBufferData(GL_UNIFORM_BUFFER, 128, nullptr, GL_DYNAMIC_DRAW); // alloc ~128 bytes
-        glBindBufferBase(GL_UNIFORM_BUFFER, 1, cameraUBO); // binding = 1 matches shader
-
-        glGenBuffers(1, &diskUBO);
-        glBindBuffer(GL_UNIFORM_BUFFER, diskUBO);
-        glBufferData(GL_UNIFORM_BUFFER, sizeof(float) * 4, nullptr, GL_DYNAMIC_DRAW); // 3 values + 1 padding
-        glBindBufferBase(GL_UNIFORM_BUFFER, 2, diskUBO); // binding = 2 matches compute shader
-
-        glGenBuffers(1, &objectsUBO);
-        glBindBuffer(GL_UNIFORM_BUFFER, objectsUBO);
-        // allocate space for 16 objects: 
-        // sizeof(int) + padding + 16×(vec4 posRadius + vec4 color)
-        GLsizeiptr objUBOSize = sizeof(int) + 3 * sizeof(float)
-            + 16 * (sizeof(vec4) + sizeof(vec4))
-            + 16 * sizeof(float); // 16 floats for mass
-        glBufferData(GL_UNIFORM_BUFFER, objUBOSize, nullptr, GL_DYNAMIC_DRAW);
-        glBindBufferBase(GL_UNIFORM_BUFFER, 3, objectsUBO);  // binding = 3 matches shader
+        shaderProgram.resolve(CreateShaderProgram());
+        gridShaderProgram.resolve(CreateShaderProgram("shaders/grid.vert", "shaders/grid.frag"));
+
+        // Compute shaders and SSBOs need GL 4.3, which macOS does not expose
+        if (GLEW_VERSION_4_3) {
+            computeProgram = CreateComputeProgram("geodesic.comp");
+            glGenBuffers(1, &objectsSSBO);
+            glGenBuffers(1, &objectGridSSBO);
+            glGenBuffers(1, &objectCellsSSBO);
+        } else {
+            cout << "[INFO] GL 4.3 not available, compute tracer disabled\n";
+        }
+        cameraBlock = uniforms.addBlock(1, 128);              // binding = 1 matches shader, alloc ~128 bytes
+        diskBlock = uniforms.addBlock(2, sizeof(float) * 4);  // binding = 2, 3 values + 1 padding
+        uniforms.create();
 
         auto result = QuadVAO();
         this->quadVAO = result[0];
         this->texture = result[1];
     }
-    void generateGrid(const vector<ObjectData>& objects) {
-        // Much larger grid for window coverage and visible well
-        const int gridSize = 200;
-        const float spacing = 1e12f; // MUCH larger grid
-
-        struct Vertex {
-            vec3 pos;
-            vec3 color;
+    // -- Adaptive grid -- //
+    // The grid is a quadtree over GRID_EXTENT: a cell splits while either the
+    // chord error of the wells across it, or its angular size seen from the
+    // camera, is too large. Leaves are drawn as outlines; a side shared with
+    // a finer neighbour is left to that neighbour's edges so no long chord
+    // cuts across the displaced surface. Cell coordinates are integers at
+    // the finest level, which also gives exact vertex deduplication.
+    static const int LOD_MIN_DEPTH = 4;   // 16x16 cells everywhere
+    static const int LOD_MAX_DEPTH = 14;  // finest cell ~ 1e10 m, about r_s of SagA
+    static constexpr float GRID_EXTENT = 2e14f;
+    static constexpr float LOD_ERROR_ANGLE = 0.003f; // ~1 px of height error at 90° fov
+    static constexpr float LOD_CELL_ANGLE = 0.15f;   // max angular size of a cell
+
+    bool refineCell(int ix, int iz, int size, int depth, const vec3& camPos) const {
+        if (depth < LOD_MIN_DEPTH) return true;
+        if (depth >= LOD_MAX_DEPTH) return false;
+        const float unit = GRID_EXTENT / (1 << LOD_MAX_DEPTH);
+        float s = size * unit;
+        float x0 = -0.5f * GRID_EXTENT + ix * unit, z0 = -0.5f * GRID_EXTENT + iz * unit;
+        auto distToCell = [&](float px, float pz) {
+            float dx = std::max(std::max(x0 - px, px - (x0 + s)), 0.0f);
+            float dz = std::max(std::max(z0 - pz, pz - (z0 + s)), 0.0f);
+            return sqrt(dx * dx + dz * dz);
         };
-        vector<Vertex> vertices;
-        vector<GLuint> indices;
-
-        // Black hole parameters (Sgr A*)
-        double mass = 4.3e6 * 1.98847e30; // kg
-        double r_s = 2.0 * 6.67430e-11 * mass / (2.99792458e8 * 2.99792458e8); // Schwarzschild radius
-
-        float minY = 1e12f, maxY = -1e12f;
-        for (int z = 0; z <= gridSize; ++z) {
-            for (int x = 0; x <= gridSize; ++x) {
-                float worldX = (x - gridSize / 2) * spacing;
-                float worldZ = (z - gridSize / 2) * spacing;
-                float dist = sqrt(worldX * worldX + worldZ * worldZ);
-
-                // Schwarzschild well: y = -sqrt(r_s / r) for r > r_s, else deep pit
-                float y;
-                if (dist > r_s) {
-                    y = -2.0f * sqrt(r_s * (dist - r_s));
-                } else {
-                    y = -2.0f * sqrt(r_s * r_s) - 1e13f;
-                }
-                minY = std::min(minY, y);
-                maxY = std::max(maxY, y);
-
-                // Color by height: deep = black, high = white
-                float normY = (y - minY) / (maxY - minY + 1e-6f);
-                vec3 color = glm::mix(vec3(0.0f, 0.0f, 0.0f), vec3(1.0f, 1.0f, 1.0f), normY);
+        // screen-space size term
+        float camDist = std::max(std::max(distToCell(camPos.x, camPos.z), std::abs(camPos.y)), 0.5f * s);
+        if (s / camDist > LOD_CELL_ANGLE) return true;
+        // curvature term: chord error of y = -2 sqrt(r_s (r - r_s)) is ~ s^2 |y''| / 8,
+        // summed through the well tree; a far node is taken at its nearest possible distance
+        float err = gridTree.sum(x0 + 0.5f * s, 0.0f, z0 + 0.5f * s,
+            [&](const wells::Node& node, float r) {
+                r = std::max(r - node.extent - 0.7072f * s, 0.5f * s);
+                return s * s * node.weight / (8.0f * r * sqrt(r));
+            },
+            [&](int k) {
+                float r = std::max(std::max(distToCell(gridTree.x[k], gridTree.z[k]), 0.5f * s), gridTree.rs[k]);
+                return s * s * sqrt(gridTree.rs[k]) / (8.0f * r * sqrt(r));
+            });
+        return err > LOD_ERROR_ANGLE * camDist;
+    }
+    // Depth of the leaf covering finest-level cell (ix, iz), -1 outside the grid
+    int leafDepthAt(int ix, int iz, const vec3& camPos) const {
+        const int N = 1 << LOD_MAX_DEPTH;
+        if (ix < 0 || iz < 0 || ix >= N || iz >= N) return -1;
+        int x0 = 0, z0 = 0, size = N, depth = 0;
+        while (refineCell(x0, z0, size, depth, camPos)) {
+            size /= 2;
+            if (ix >= x0 + size) x0 += size;
+            if (iz >= z0 + size) z0 += size;
+            depth++;
+        }
+        return depth;
+    }
+    GLuint lodVertex(int ix, int iz) {
+        const int N = 1 << LOD_MAX_DEPTH;
+        uint32_t key = uint32_t(ix) * (N + 1) + uint32_t(iz);
+        auto it = lodVertexIds.find(key);
+        if (it != lodVertexIds.end()) return it->second;
+        const float unit = GRID_EXTENT / N;
+        GLuint id = GLuint(lodVertices.size());
+        lodVertices.push_back(vec3(-0.5f * GRID_EXTENT + ix * unit, 0.0f, -0.5f * GRID_EXTENT + iz * unit));
+        lodVertexIds[key] = id;
+        return id;
+    }
+    void lodEdge(int ax, int az, int bx, int bz) {
+        GLuint a = lodVertex(ax, az), b = lodVertex(bx, bz);
+        uint64_t key = (uint64_t(std::min(a, b)) << 32) | std::max(a, b);
+        if (!lodEdges.insert(key).second) return;
+        lodIndices.push_back(a);
+        lodIndices.push_back(b);
+    }
+    void buildLodCell(int x0, int z0, int size, int depth, const vec3& camPos) {
+        if (refineCell(x0, z0, size, depth, camPos)) {
+            int h = size / 2;
+            buildLodCell(x0,     z0,     h, depth + 1, camPos);
+            buildLodCell(x0 + h, z0,     h, depth + 1, camPos);
+            buildLodCell(x0,     z0 + h, h, depth + 1, camPos);
+            buildLodCell(x0 + h, z0 + h, h, depth + 1, camPos);
+            return;
+        }
+        int x1 = x0 + size, z1 = z0 + size, mid = size / 2;
+        if (leafDepthAt(x0 + mid, z0 - 1, camPos) <= depth) lodEdge(x0, z0, x1, z0);
+        if (leafDepthAt(x0 + mid, z1,     camPos) <= depth) lodEdge(x0, z1, x1, z1);
+        if (leafDepthAt(x0 - 1, z0 + mid, camPos) <= depth) lodEdge(x0, z0, x0, z1);
+        if (leafDepthAt(x1,     z0 + mid, camPos) <= depth) lodEdge(x1, z0, x1, z1);
+    }
 
-                vertices.push_back({vec3(worldX, y, worldZ), color});
-            }
+    // A well can move a quarter of the leaf cell it sits in, or change r_s
+    // by 5%, before the refinement around it is stale
+    static constexpr float LOD_WELL_SLACK = 0.25f;
+    static constexpr float LOD_WELL_RS_SLACK = 0.05f;
+    bool meshStale() const {
+        if (meshWells.size() != gridWells.size()) return true;
+        for (size_t i = 0; i < gridWells.size(); ++i) {
+            const vec4 &now = gridWells[i], &then = meshWells[i];
+            float dx = now.x - then.x, dz = now.z - then.z;
+            if (dx * dx + dz * dz > meshWellSlack[i] * meshWellSlack[i]) return true;
+            if (std::abs(now.w - then.w) > LOD_WELL_RS_SLACK * then.w) return true;
         }
+        return false;
+    }
+    void recordMeshWells(const vec3& camPos) {
+        const int N = 1 << LOD_MAX_DEPTH;
+        const float unit = GRID_EXTENT / N;
+        meshWells = gridWells;
+        meshWellSlack.resize(gridWells.size());
+        for (size_t i = 0; i < gridWells.size(); ++i) {
+            int ix = int(std::floor((gridWells[i].x + 0.5f * GRID_EXTENT) / unit));
+            int iz = int(std::floor((gridWells[i].z + 0.5f * GRID_EXTENT) / unit));
+            int depth = leafDepthAt(ix, iz, camPos);
+            if (depth < 0) depth = LOD_MIN_DEPTH;   // off the grid: its pull on the edge is gentle
+            meshWellSlack[i] = LOD_WELL_SLACK * unit * float(N >> depth);
+        }
+    }
 
-        // Indices for GL_LINE rendering
-        for (int z = 0; z < gridSize; ++z) {
-            for (int x = 0; x < gridSize; ++x) {
-                int i = z * (gridSize + 1) + x;
-                indices.push_back(i);
-                indices.push_back(i + 1);
+    // The mesh is flat; shaders/grid.vert sums the wells by walking a
+    // wells::Tree uploaded to a texture buffer, so moving wells only
+    // re-upload the tree. The quadtree mesh is rebuilt when the camera has
+    // moved noticeably or a well has moved far enough to change the
+    // refinement around it, and its buffers are re-uploaded only if the
+    // rebuilt mesh differs.
+    void updateGrid(const vector<ObjectData>& objects, const Camera& cam) {
+        const double G = 6.67430e-11, c = 2.99792458e8;
+
+        // xyz = position, w = Schwarzschild radius, compared against the last upload
+        gridWells.resize(objects.size());
+        for (size_t i = 0; i < objects.size(); ++i) {
+            const vec4& pr = objects[i].posRadius;
+            gridWells[i] = vec4(pr.x, pr.y, pr.z, float(2.0 * G * objects[i].mass / (c * c)));
+        }
+        bool wellsChanged = !gridWellsUploaded || gridWells != lastGridWells;
+        vec3 camPos = cam.position();
+        float camRange = std::max(length(camPos - cam.target), cam.minRadius);
+        bool camMoved = gridVAO == 0 || length(camPos - gridCamPos) > 0.05f * camRange;
+        if (!wellsChanged && !camMoved) return;
+
+        if (gridVAO == 0) {
+            glGenVertexArrays(1, &gridVAO);
+            glGenBuffers(1, &gridVBO);
+            glGenBuffers(1, &gridEBO);
+            glstate::state().bindVertexArray(gridVAO);
+            glBindBuffer(GL_ARRAY_BUFFER, gridVBO);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gridEBO);
+            glEnableVertexAttribArray(0);
+            glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(vec3), (void*)0);
+
+            glGenBuffers(1, &gridWellsTBO);
+            glGenTextures(1, &gridWellsTexture);
+            glGenBuffers(1, &gridTreeTBO);
+            glGenTextures(1, &gridTreeTexture);
+        }
 
-                indices.push_back(i);
-                indices.push_back(i + gridSize + 1);
+        if (wellsChanged) {
+            lastGridWells = gridWells;
+            gridWellsUploaded = true;
+            const size_t n = gridWells.size();
+            wellX.resize(n); wellZ.resize(n); wellRs.resize(n);
+            for (size_t i = 0; i < n; ++i) {
+                wellX[i] = gridWells[i].x;
+                wellZ[i] = gridWells[i].z;
+                wellRs[i] = gridWells[i].w;
+            }
+            gridTree.build(wellX.data(), nullptr, wellZ.data(), wellRs.data(), n);
+
+            // texel 2i = centroid xz, weight, extent; 2i + 1 = skip, first, count, shift
+            gridTreeTexels.resize(2 * gridTree.nodes.size());
+            for (size_t i = 0; i < gridTree.nodes.size(); ++i) {
+                const wells::Node& node = gridTree.nodes[i];
+                gridTreeTexels[2 * i] = vec4(node.x, node.z, node.weight, node.extent);
+                gridTreeTexels[2 * i + 1] = vec4(float(node.skip), float(node.first), float(node.count), node.shift);
+            }
+            gridTreeWells.resize(n);
+            for (size_t k = 0; k < n; ++k) gridTreeWells[k] = vec4(gridTree.x[k], 0.0f, gridTree.z[k], gridTree.rs[k]);
+
+            glBindBuffer(GL_TEXTURE_BUFFER, gridWellsTBO);
+            glBufferData(GL_TEXTURE_BUFFER, std::max<size_t>(n, 1) * sizeof(vec4), gridTreeWells.data(), GL_DYNAMIC_DRAW);
+            glstate::state().bindTexture(0, GL_TEXTURE_BUFFER, gridWellsTexture);
+            glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, gridWellsTBO);
+            glBindBuffer(GL_TEXTURE_BUFFER, gridTreeTBO);
+            glBufferData(GL_TEXTURE_BUFFER, std::max<size_t>(gridTreeTexels.size(), 1) * sizeof(vec4), gridTreeTexels.data(), GL_DYNAMIC_DRAW);
+            glstate::state().bindTexture(1, GL_TEXTURE_BUFFER, gridTreeTexture);
+            glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, gridTreeTBO);
+
+            // Colour range: deepest at a well centre, highest at a grid corner
+            auto depthAt = [&](float px, float pz) {
+                return -2.0f * gridTree.sum(px, 0.0f, pz,
+                    [](const wells::Node& node, float r) { return node.weight * sqrt(r - node.shift); },
+                    [&](int k) {
+                        float dx = px - gridTree.x[k], dz = pz - gridTree.z[k], rs = gridTree.rs[k];
+                        float dist = sqrt(dx * dx + dz * dz);
+                        return dist > rs ? sqrt(rs * (dist - rs)) : rs + 5e12f;
+                    });
+            };
+            const float half = 0.5f * GRID_EXTENT;
+            gridHeightRange = vec2(1e30f, -1e30f);
+            const float corners[4][2] = { {-half, -half}, {half, -half}, {-half, half}, {half, half} };
+            for (const auto& p : corners) {
+                float y = depthAt(p[0], p[1]);
+                gridHeightRange = vec2(std::min(gridHeightRange.x, y), std::max(gridHeightRange.y, y));
+            }
+            for (const auto& w : gridWells) {
+                if (std::abs(w.x) > half || std::abs(w.z) > half) continue;
+                gridHeightRange.x = std::min(gridHeightRange.x, depthAt(w.x, w.z));
             }
         }
 
-        // Upload to GPU
-        if (gridVAO == 0) glGenVertexArrays(1, &gridVAO);
-        if (gridVBO == 0) glGenBuffers(1, &gridVBO);
-        if (gridEBO == 0) glGenBuffers(1, &gridEBO);
+        if (!camMoved && !meshStale()) return;
 
-        glBindVertexArray(gridVAO);
+        // Rebuild the quadtree mesh
+        gridCamPos = camPos;
+        recordMeshWells(camPos);
+        lodVertices.clear();
+        lodIndices.clear();
+        lodVertexIds.clear();
+        lodEdges.clear();
+        buildLodCell(0, 0, 1 << LOD_MAX_DEPTH, 0, camPos);
+        if (lodIndices == uploadedIndices && lodVertices == uploadedVertices) return;
 
         glBindBuffer(GL_ARRAY_BUFFER, gridVBO);
-        glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), vertices.data(), GL_DYNAMIC_DRAW);
-
+        glBufferData(GL_ARRAY_BUFFER, lodVertices.size() * sizeof(vec3), lodVertices.data(), GL_DYNAMIC_DRAW);
+        glstate::state().bindVertexArray(gridVAO);
         glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gridEBO);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint), indices.data(), GL_STATIC_DRAW);
-
-        glEnableVertexAttribArray(0);
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)0);
-
-        glEnableVertexAttribArray(1);
-        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, color));
-
-        gridIndexCount = indices.size();
-
-        glBindVertexArray(0);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, lodIndices.size() * sizeof(GLuint), lodIndices.data(), GL_DYNAMIC_DRAW);
+        gridIndexCount = lodIndices.size();
+        uploadedVertices.swap(lodVertices);
+        uploadedIndices.swap(lodIndices);
     }
     void drawGrid(const mat4& viewProj) {
-        glUseProgram(gridShaderProgram);
-        glUniformMatrix4fv(glGetUniformLocation(gridShaderProgram, "uViewProj"),
-                        1, GL_FALSE, glm::value_ptr(viewProj));
-        glBindVertexArray(gridVAO);
-
-        glDisable(GL_DEPTH_TEST);
-        glEnable(GL_BLEND);
-        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        glstate::State& gl = glstate::state();
+        gl.useProgram(gridShaderProgram.id);
+        gridShaderProgram.set("uViewProj", viewProj);
+        gl.bindTexture(0, GL_TEXTURE_BUFFER, gridWellsTexture);
+        gridShaderProgram.set("uWells", 0);
+        gl.bindTexture(1, GL_TEXTURE_BUFFER, gridTreeTexture);
+        gridShaderProgram.set("uWellTree", 1);
+        gridShaderProgram.set("uNumNodes", (GLint)gridTree.nodes.size());
+        gridShaderProgram.set("uTheta", gridTree.theta);
+        gridShaderProgram.set("uHeightRange", gridHeightRange);
+        gl.bindVertexArray(gridVAO);
+
+        gl.disable(GL_DEPTH_TEST);
+        gl.enable(GL_BLEND);
+        gl.blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
         glDrawElements(GL_LINES, gridIndexCount, GL_UNSIGNED_INT, 0);
-
-        glBindVertexArray(0);
-        glEnable(GL_DEPTH_TEST);
     }
     void drawFullScreenQuad() {
-        glUseProgram(shaderProgram); // fragment + vertex shader
-        glBindVertexArray(quadVAO);
-
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, texture);
-        glUniform1i(glGetUniformLocation(shaderProgram, "screenTexture"), 0);
+        glstate::State& gl = glstate::state();
+        gl.useProgram(shaderProgram.id); // fragment + vertex shader
+        gl.bindVertexArray(quadVAO);
+        gl.bindTexture(0, GL_TEXTURE_2D, texture);
+        shaderProgram.set("screenTexture", 0);
 
-        glDisable(GL_DEPTH_TEST);  // draw as background
+        gl.disable(GL_DEPTH_TEST);  // draw as background
         glDrawArrays(GL_TRIANGLE_STRIP, 0, 6);  // 2 triangles
-        glEnable(GL_DEPTH_TEST);
     }
     GLuint CreateShaderProgram(){
         const char* vertexShaderSource = R"(
@@ -491,30 +925,41 @@ struct Engine {
         glDeleteShader(cs);
         return prog;
     }
-    void dispatchCompute(const Camera& cam) {
+    // Returns false when the still image has converged and nothing was traced
+    bool dispatchCompute(const Camera& cam) {
         // determine target compute‐res
         int cw = cam.moving ? COMPUTE_WIDTH  : 200;
         int ch = cam.moving ? COMPUTE_HEIGHT : 150;
 
-        // 1) reallocate the texture if needed
-        glBindTexture(GL_TEXTURE_2D, texture);
-        glTexImage2D(GL_TEXTURE_2D,
-                    0,                // mip
-                    GL_RGBA8,         // internal format
-                    cw,               // width
-                    ch,               // height
-                    0, GL_RGBA, 
-                    GL_UNSIGNED_BYTE, 
-                    nullptr);
+        // 1) reallocate the textures only when the size changes
+        if (cw != traceWidth || ch != traceHeight) {
+            glstate::state().bindTexture(0, GL_TEXTURE_2D, texture);
+            glTexImage2D(GL_TEXTURE_2D,
+                        0,                // mip
+                        GL_RGBA8,         // internal format
+                        cw,               // width
+                        ch,               // height
+                        0, GL_RGBA, 
+                        GL_UNSIGNED_BYTE, 
+                        nullptr);
+            if (!historyTexture) glGenTextures(1, &historyTexture);
+            glstate::state().bindTexture(0, GL_TEXTURE_2D, historyTexture);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, cw, ch, 0, GL_RGBA, GL_FLOAT, nullptr);
+            traceWidth = cw;
+            traceHeight = ch;
+            sampleCount = 0;
+        }
 
         // 2) bind compute program & UBOs
-        glUseProgram(computeProgram);
-        uploadCameraUBO(cam);
+        glstate::state().useProgram(computeProgram);
+        bool objectsChanged = uploadObjectsSSBO(objects);
+        if (!uploadCameraUBO(cam, objectsChanged)) return false;
         uploadDiskUBO();
-        uploadObjectsUBO(objects);
+        uniforms.commit();
 
-        // 3) bind it as image unit 0
+        // 3) bind output as image unit 0, running average as unit 1
         glBindImageTexture(0, texture, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA8);
+        glBindImageTexture(1, historyTexture, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA16F);
 
         // 4) dispatch grid
         GLuint groupsX = (GLuint)std::ceil(cw / 16.0f);
@@ -523,8 +968,22 @@ struct Engine {
 
         // 5) sync
         glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+        uniforms.endFrame();
+        return true;
+    }
+    // Low-discrepancy sub-pixel offsets for the accumulated samples
+    static float halton(int index, int base) {
+        float f = 1.0f, r = 0.0f;
+        for (; index > 0; index /= base) {
+            f /= base;
+            r += f * (index % base);
+        }
+        return r;
     }
-    void uploadCameraUBO(const Camera& cam) {
+    // Fills the camera block. The pose is compared with the previous frame:
+    // any change (or resetHistory) restarts accumulation. Returns false once
+    // a still view has MAX_SAMPLES samples and tracing more would be wasted.
+    bool uploadCameraUBO(const Camera& cam, bool resetHistory) {
         struct UBOData {
             vec3 pos; float _pad0;
             vec3 right; float _pad1;
@@ -534,13 +993,19 @@ struct Engine {
             float aspect;
             bool moving;
             int _pad4;
+            vec2 jitter;       // sub-pixel offset in pixels, [-0.5, 0.5)
+            int sampleCount;   // samples already in the history image
+            int _pad5;
         } data;
+        static_assert(sizeof(UBOData) <= 128, "camera block is allocated 128 bytes");
+        unsigned char block[128];
+        std::memset(&data, 0, sizeof(data)); // zero padding so the dirty check is stable
         vec3 fwd = normalize(cam.target - cam.position());
         vec3 up = vec3(0, 1, 0); // y axis is up, so disk is in x-z plane
         vec3 right = normalize(cross(fwd, up));
         up = cross(right, fwd);
 
-        data.pos = cam.position();
+        data.pos = toGeom(cam.position());
         data.right = right;
         data.up = up;
         data.forward = fwd;
@@ -548,41 +1013,139 @@ struct Engine {
         data.aspect = float(WIDTH) / float(HEIGHT);
         data.moving = cam.dragging || cam.panning;
 
-        glBindBuffer(GL_UNIFORM_BUFFER, cameraUBO);
-        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(UBOData), &data);
-    }
-    void uploadObjectsUBO(const vector<ObjectData>& objs) {
-        struct UBOData {
-            int   numObjects;
-            float _pad0, _pad1, _pad2;        // <-- pad out to 16 bytes
-            vec4  posRadius[16];
-            vec4  color[16];
-            float  mass[16]; 
-        } data;
+        const size_t poseSize = offsetof(UBOData, jitter);
+        if (resetHistory || std::memcmp(lastPose, &data, poseSize) != 0) {
+            std::memcpy(lastPose, &data, poseSize);
+            sampleCount = 0;
+        }
+        if (sampleCount >= MAX_SAMPLES) return false;
+        if (data.moving) {
+            data.jitter = vec2(0.0f);
+            sampleCount = 0;   // keep overwriting until the camera settles
+        } else {
+            data.jitter = vec2(halton(sampleCount + 1, 2), halton(sampleCount + 1, 3)) - vec2(0.5f);
+        }
+        data.sampleCount = sampleCount;
+        if (!data.moving) sampleCount++;
 
-        size_t count = std::min(objs.size(), size_t(16));
-        data.numObjects = static_cast<int>(count);
+        std::memset(block, 0, sizeof(block));
+        std::memcpy(block, &data, sizeof(data));
+        uniforms.write(cameraBlock, block);
+        return true;
+    }
+    // (Re)allocate an SSBO only when it has to grow, otherwise update in place
+    void uploadSSBO(GLuint buffer, GLuint binding, GLsizeiptr& capacity, GLsizeiptr size, const void* data) {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+        if (size > capacity) {
+            capacity = size + size / 2;
+            glBufferData(GL_SHADER_STORAGE_BUFFER, capacity, nullptr, GL_DYNAMIC_DRAW);
+        }
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, size, data);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding, buffer);
+    }
+    // Returns true if the objects differ from the last upload
+    bool uploadObjectsSSBO(const vector<ObjectData>& objs) {
+        // Objects block: int count padded to 16 bytes, then SceneObject[]
+        const size_t headerSize = 4 * sizeof(int);
+        int header[4] = { static_cast<int>(objs.size()), 0, 0, 0 };
+        packedObjects.resize(headerSize + objs.size() * sizeof(GPUObject));
+        std::memcpy(packedObjects.data(), header, headerSize);
+        gpuObjects.resize(objs.size());
+        for (size_t i = 0; i < objs.size(); ++i) {
+            GPUObject& o = gpuObjects[i];
+            const vec4& pr = objs[i].posRadius;
+            o.posRadius = vec4(toGeom(vec3(pr.x, pr.y, pr.z)), toGeom(pr.w));
+            o.color = objs[i].color;
+            o.mass = objs[i].mass;
+            o._pad0 = o._pad1 = o._pad2 = 0.0f;
+        }
+        if (!gpuObjects.empty())
+            std::memcpy(packedObjects.data() + headerSize, gpuObjects.data(), gpuObjects.size() * sizeof(GPUObject));
+        // static scenes: skip the upload and the grid rebuild entirely
+        if (objectsUploaded && packedObjects == lastPackedObjects) return false;
+        lastPackedObjects = packedObjects;
+        objectsUploaded = true;
+        uploadSSBO(objectsSSBO, 3, objectsSSBOSize, packedObjects.size(), packedObjects.data());
+
+        buildObjectGrid(gpuObjects);
+        return true;
+    }
+    // Bin every object's bounding box into a uniform grid so the per-step
+    // intersection test in geodesic.comp only visits objects near the ray.
+    // Counting sort, O(objects + covered cells).
+    void buildObjectGrid(const vector<GPUObject>& objs) {
+        const int MAX_DIM = 64;
+        GPUObjectGrid header;
+        vec3 lo(0.0f), hi(0.0f);
+        if (!objs.empty()) {
+            lo = vec3(1e30f);
+            hi = vec3(-1e30f);
+        }
+        for (const auto& o : objs) {
+            vec3 p(o.posRadius.x, o.posRadius.y, o.posRadius.z);
+            float r = o.posRadius.w;
+            lo = glm::min(lo, p - vec3(r));
+            hi = glm::max(hi, p + vec3(r));
+        }
+        vec3 extent = glm::max(hi - lo, vec3(1.0f));
+        // aim for roughly one object per cell
+        float volume = extent.x * extent.y * extent.z;
+        float cellSize = std::cbrt(volume / float(std::max<size_t>(objs.size(), 1)));
+        int dims[3];
+        for (int a = 0; a < 3; ++a) {
+            dims[a] = glm::clamp(int(std::ceil(extent[a] / cellSize)), 1, MAX_DIM);
+            header.gridInvCell[a] = float(dims[a]) / extent[a];
+            header.gridMin[a] = lo[a];
+            header.gridDims[a] = dims[a];
+        }
+        header.gridMin.w = header.gridInvCell.w = 0.0f;
+        header.gridDims[3] = 0;
+        size_t numCells = size_t(dims[0]) * dims[1] * dims[2];
+
+        auto cellRange = [&](const GPUObject& o, ivec3& c0, ivec3& c1) {
+            for (int a = 0; a < 3; ++a) {
+                float p = o.posRadius[a], r = o.posRadius.w;
+                c0[a] = glm::clamp(int(std::floor((p - r - lo[a]) * header.gridInvCell[a])), 0, dims[a] - 1);
+                c1[a] = glm::clamp(int(std::floor((p + r - lo[a]) * header.gridInvCell[a])), 0, dims[a] - 1);
+            }
+        };
 
-        for (size_t i = 0; i < count; ++i) {
-            data.posRadius[i] = objs[i].posRadius;
-            data.color[i] = objs[i].color;
-            data.mass[i] = objs[i].mass;
+        // 1) count objects per cell, 2) prefix sum, 3) scatter indices
+        cellStart.assign(numCells + 1, 0);
+        ivec3 c0, c1;
+        for (const auto& o : objs) {
+            cellRange(o, c0, c1);
+            for (int z = c0.z; z <= c1.z; ++z)
+                for (int y = c0.y; y <= c1.y; ++y)
+                    for (int x = c0.x; x <= c1.x; ++x)
+                        cellStart[(size_t(z) * dims[1] + y) * dims[0] + x + 1]++;
+        }
+        for (size_t c = 0; c < numCells; ++c) cellStart[c + 1] += cellStart[c];
+        cellFill.assign(cellStart.begin(), cellStart.end() - 1);
+        cellObjects.resize(std::max<GLuint>(cellStart[numCells], 1));
+        for (size_t i = 0; i < objs.size(); ++i) {
+            cellRange(objs[i], c0, c1);
+            for (int z = c0.z; z <= c1.z; ++z)
+                for (int y = c0.y; y <= c1.y; ++y)
+                    for (int x = c0.x; x <= c1.x; ++x)
+                        cellObjects[cellFill[(size_t(z) * dims[1] + y) * dims[0] + x]++] = GLuint(i);
         }
 
-        // Upload
-        glBindBuffer(GL_UNIFORM_BUFFER, objectsUBO);
-        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(data), &data);
+        packedGrid.resize(sizeof(header) + cellStart.size() * sizeof(GLuint));
+        std::memcpy(packedGrid.data(), &header, sizeof(header));
+        std::memcpy(packedGrid.data() + sizeof(header), cellStart.data(), cellStart.size() * sizeof(GLuint));
+        uploadSSBO(objectGridSSBO, 4, objectGridSSBOSize, packedGrid.size(), packedGrid.data());
+        uploadSSBO(objectCellsSSBO, 5, objectCellsSSBOSize, cellObjects.size() * sizeof(GLuint), cellObjects.data());
     }
     void uploadDiskUBO() {
         // disk
-        float r1 = SagA.r_s * 2.2f;    // inner radius just outside the event horizon
-        float r2 = SagA.r_s * 5.2f;   // outer radius of the disk
-        float num = 2.0;               // number of rays
-        float thickness = 1e9f;          // padding for std140 alignment
+        float r1 = toGeom(SagA.r_s * 2.2);  // inner radius just outside the event horizon
+        float r2 = toGeom(SagA.r_s * 5.2);  // outer radius of the disk
+        float num = 2.0;                    // number of rays
+        float thickness = toGeom(1e9);      // padding for std140 alignment
         float diskData[4] = { r1, r2, num, thickness };
 
-        glBindBuffer(GL_UNIFORM_BUFFER, diskUBO);
-        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(diskData), diskData);
+        uniforms.write(diskBlock, diskData); // no-op unless the values changed
     }
     
     vector<GLuint> QuadVAO(){
@@ -601,7 +1164,7 @@ struct Engine {
         glGenVertexArrays(1, &VAO);
         glGenBuffers(1, &VBO);
 
-        glBindVertexArray(VAO);
+        glstate::state().bindVertexArray(VAO);
         glBindBuffer(GL_ARRAY_BUFFER, VBO);
         glBufferData(GL_ARRAY_BUFFER, sizeof(quadVertices), quadVertices, GL_STATIC_DRAW);
 
@@ -612,10 +1175,9 @@ struct Engine {
 
         GLuint texture;
         glGenTextures(1, &texture);
-        glBindTexture(GL_TEXTURE_2D, texture);
+        glstate::state().bindTexture(0, GL_TEXTURE_2D, texture);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glBindTexture(GL_TEXTURE_2D, texture);
         glTexImage2D(GL_TEXTURE_2D,
                     0,             // mip
                     GL_RGBA8,      // internal format
@@ -630,17 +1192,281 @@ struct Engine {
     }
     void renderScene() {
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-        glUseProgram(shaderProgram);
-        glBindVertexArray(quadVAO);
+        glstate::state().useProgram(shaderProgram.id);
+        glstate::state().bindVertexArray(quadVAO);
         // make sure your fragment shader samples from texture unit 0:
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, texture);
+        glstate::state().bindTexture(0, GL_TEXTURE_2D, texture);
         glDrawArrays(GL_TRIANGLES, 0, 6);
         glfwSwapBuffers(window);
         glfwPollEvents();
     };
 };
 Engine engine;
+// -- Performance instrumentation -- //
+// GPU passes are timed with GL_TIME_ELAPSED queries. Every pass owns two
+// query objects and the HUD reads the set issued the previous frame, so
+// collecting results never waits on the GPU.
+enum GpuPass { GPU_COMPUTE, GPU_GRID, GPU_QUAD, GPU_PASS_COUNT };
+enum CpuStage { CPU_PHYSICS, CPU_GRID, CPU_COMPUTE, CPU_QUAD, CPU_PRESENT, CPU_STAGE_COUNT };
+const char* GPU_PASS_NAMES[GPU_PASS_COUNT] = { "compute", "grid", "quad" };
+const char* CPU_STAGE_NAMES[CPU_STAGE_COUNT] = { "physics", "grid", "compute", "quad", "present" };
+bool ShowHud = true;
+
+// 5x7 bitmap font, one byte per row (low 5 bits), for the HUD overlay
+const char* HUD_CHARS = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ .:/-%+";
+const unsigned char HUD_FONT[][7] = {
+    {0x0E,0x11,0x13,0x15,0x19,0x11,0x0E}, {0x04,0x0C,0x04,0x04,0x04,0x04,0x0E}, // 0 1
+    {0x0E,0x11,0x01,0x02,0x04,0x08,0x1F}, {0x1F,0x02,0x04,0x02,0x01,0x11,0x0E}, // 2 3
+    {0x02,0x06,0x0A,0x12,0x1F,0x02,0x02}, {0x1F,0x10,0x1E,0x01,0x01,0x11,0x0E}, // 4 5
+    {0x06,0x08,0x10,0x1E,0x11,0x11,0x0E}, {0x1F,0x01,0x02,0x04,0x08,0x08,0x08}, // 6 7
+    {0x0E,0x11,0x11,0x0E,0x11,0x11,0x0E}, {0x0E,0x11,0x11,0x0F,0x01,0x02,0x0C}, // 8 9
+    {0x0E,0x11,0x11,0x1F,0x11,0x11,0x11}, {0x1E,0x11,0x11,0x1E,0x11,0x11,0x1E}, // A B
+    {0x0E,0x11,0x10,0x10,0x10,0x11,0x0E}, {0x1C,0x12,0x11,0x11,0x11,0x12,0x1C}, // C D
+    {0x1F,0x10,0x10,0x1E,0x10,0x10,0x1F}, {0x1F,0x10,0x10,0x1E,0x10,0x10,0x10}, // E F
+    {0x0E,0x11,0x10,0x17,0x11,0x11,0x0F}, {0x11,0x11,0x11,0x1F,0x11,0x11,0x11}, // G H
+    {0x0E,0x04,0x04,0x04,0x04,0x04,0x0E}, {0x07,0x02,0x02,0x02,0x02,0x12,0x0C}, // I J
+    {0x11,0x12,0x14,0x18,0x14,0x12,0x11}, {0x10,0x10,0x10,0x10,0x10,0x10,0x1F}, // K L
+    {0x11,0x1B,0x15,0x15,0x11,0x11,0x11}, {0x11,0x11,0x19,0x15,0x13,0x11,0x11}, // M N
+    {0x0E,0x11,0x11,0x11,0x11,0x11,0x0E}, {0x1E,0x11,0x11,0x1E,0x10,0x10,0x10}, // O P
+    {0x0E,0x11,0x11,0x11,0x15,0x12,0x0D}, {0x1E,0x11,0x11,0x1E,0x14,0x12,0x11}, // Q R
+    {0x0F,0x10,0x10,0x0E,0x01,0x01,0x1E}, {0x1F,0x04,0x04,0x04,0x04,0x04,0x04}, // S T
+    {0x11,0x11,0x11,0x11,0x11,0x11,0x0E}, {0x11,0x11,0x11,0x11,0x11,0x0A,0x04}, // U V
+    {0x11,0x11,0x11,0x15,0x15,0x15,0x0A}, {0x11,0x11,0x0A,0x04,0x0A,0x11,0x11}, // W X
+    {0x11,0x11,0x11,0x0A,0x04,0x04,0x04}, {0x1F,0x01,0x02,0x04,0x08,0x10,0x1F}, // Y Z
+    {0x00,0x00,0x00,0x00,0x00,0x00,0x00}, {0x00,0x00,0x00,0x00,0x00,0x0C,0x0C}, // space .
+    {0x00,0x0C,0x0C,0x00,0x0C,0x0C,0x00}, {0x00,0x01,0x02,0x04,0x08,0x10,0x00}, // : /
+    {0x00,0x00,0x00,0x1F,0x00,0x00,0x00}, {0x18,0x19,0x02,0x04,0x08,0x13,0x03}, // - %
+    {0x00,0x04,0x04,0x1F,0x04,0x04,0x00},                                      // +
+};
+
+struct PerfStats {
+    // -- GPU timer queries, double buffered -- //
+    GLuint queries[2][GPU_PASS_COUNT] = {};
+    bool issued[2][GPU_PASS_COUNT] = {};
+    int queryFrame = 0;
+    bool timersSupported = false;
+    double gpuMs[GPU_PASS_COUNT] = {};
+    double cpuMs[CPU_STAGE_COUNT] = {};
+    double raysPerSec = 0.0;
+    double energyDrift = 0.0;   // relative N-body energy error, refreshed with the HUD
+    long long raysThisFrame = 0;
+    Clock::time_point stageStart;
+
+    // -- per-interval averages shown on the HUD -- //
+    double gpuSum[GPU_PASS_COUNT] = {};
+    double cpuSum[CPU_STAGE_COUNT] = {};
+    double raysSum = 0.0;
+    int samples = 0;
+    glstate::Stats glCalls;         // state changes issued and elided, last frame
+
+    // -- HUD overlay -- //
+    static const int HUD_W = 256, HUD_H = 64;     // room for 6 lines
+    static const int HUD_GLYPH_W = 6, HUD_LINE_H = 10;
+    glstate::Program hudProgram;
+    GLuint hudVAO = 0, hudVBO = 0, hudTexture = 0;
+    vector<unsigned char> hudPixels;
+
+    ofstream csv;
+    long long frameIndex = 0;
+
+    void init(const char* csvPath) {
+        timersSupported = GLEW_VERSION_3_3 || GLEW_ARB_timer_query;
+        if (timersSupported) glGenQueries(2 * GPU_PASS_COUNT, &queries[0][0]);
+        initHud();
+        if (csvPath) {
+            // runs append to the same file; only a new file gets the header
+            ifstream existing(csvPath, ios::ate | ios::binary);
+            const bool empty = !existing.is_open() || existing.tellg() <= 0;
+            existing.close();
+            csv.open(csvPath, ios::app);
+            if (!csv.is_open()) {
+                cerr << "[WARN] Could not open perf CSV: " << csvPath << "\n";
+            } else if (empty) {
+                csv << "frame,time";
+                for (int p = 0; p < GPU_PASS_COUNT; ++p) csv << ",gpu_" << GPU_PASS_NAMES[p] << "_ms";
+                for (int s = 0; s < CPU_STAGE_COUNT; ++s) csv << ",cpu_" << CPU_STAGE_NAMES[s] << "_ms";
+                csv << ",rays_per_sec,gl_issued,gl_elided\n";
+            }
+        }
+    }
+
+    void beginGpu(GpuPass pass) {
+        if (timersSupported) glBeginQuery(GL_TIME_ELAPSED, queries[queryFrame][pass]);
+    }
+    void endGpu(GpuPass pass) {
+        if (!timersSupported) return;
+        glEndQuery(GL_TIME_ELAPSED);
+        issued[queryFrame][pass] = true;
+    }
+
+    void beginCpu() { stageStart = Clock::now(); }
+    // Close the current CPU stage and start timing the next one
+    void endCpu(CpuStage stage) {
+        auto now = Clock::now();
+        cpuMs[stage] = chrono::duration<double, milli>(now - stageStart).count();
+        stageStart = now;
+    }
+
+    // Read back the previous frame's queries (skipping any that are not
+    // ready yet), log the frame and flip to the other query set.
+    void endFrame(double time) {
+        int prev = queryFrame ^ 1;
+        for (int p = 0; p < GPU_PASS_COUNT; ++p) {
+            if (!issued[prev][p]) continue;
+            GLint available = 0;
+            glGetQueryObjectiv(queries[prev][p], GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available) continue;
+            GLuint64 ns = 0;
+            glGetQueryObjectui64v(queries[prev][p], GL_QUERY_RESULT, &ns);
+            gpuMs[p] = ns * 1e-6;
+            issued[prev][p] = false;
+        }
+        if (raysThisFrame > 0 && gpuMs[GPU_COMPUTE] > 0.0)
+            raysPerSec = raysThisFrame / (gpuMs[GPU_COMPUTE] * 1e-3);
+        raysThisFrame = 0;
+        glCalls = glstate::state().endFrame();
+
+        for (int p = 0; p < GPU_PASS_COUNT; ++p) gpuSum[p] += gpuMs[p];
+        for (int s = 0; s < CPU_STAGE_COUNT; ++s) cpuSum[s] += cpuMs[s];
+        raysSum += raysPerSec;
+        samples++;
+
+        if (csv.is_open()) {
+            csv << frameIndex << "," << time;
+            for (int p = 0; p < GPU_PASS_COUNT; ++p) csv << "," << gpuMs[p];
+            for (int s = 0; s < CPU_STAGE_COUNT; ++s) csv << "," << cpuMs[s];
+            csv << "," << raysPerSec << "," << glCalls.issued << "," << glCalls.elided << "\n";
+        }
+        frameIndex++;
+        queryFrame = prev;
+    }
+
+    // Average the interval's samples into the HUD texture
+    void updateHud(double fps) {
+        if (samples == 0) return;
+        ostringstream l0;
+        l0 << fixed << setprecision(1) << "FPS " << fps << "  RAYS/S " << setprecision(2) << raysSum / samples * 1e-6 << "M"
+           << "  DE " << scientific << setprecision(1) << energyDrift;
+        vector<string> lines(1, l0.str()), gpu, cpu;
+        for (int p = 0; p < GPU_PASS_COUNT; ++p) gpu.push_back(timing(GPU_PASS_NAMES[p], gpuSum[p] / samples));
+        for (int s = 0; s < CPU_STAGE_COUNT; ++s) cpu.push_back(timing(CPU_STAGE_NAMES[s], cpuSum[s] / samples));
+        wrap(lines, "GPU MS", gpu);
+        wrap(lines, "CPU MS", cpu);
+        for (int p = 0; p < GPU_PASS_COUNT; ++p) gpuSum[p] = 0.0;
+        for (int s = 0; s < CPU_STAGE_COUNT; ++s) cpuSum[s] = 0.0;
+        raysSum = 0.0;
+        samples = 0;
+
+        std::fill(hudPixels.begin(), hudPixels.end(), 0);
+        for (size_t line = 0; line < lines.size(); ++line) drawText(lines[line], 2, 2 + int(line) * HUD_LINE_H);
+        glstate::state().bindTexture(0, GL_TEXTURE_2D, hudTexture);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, HUD_W, HUD_H, GL_RGBA, GL_UNSIGNED_BYTE, hudPixels.data());
+    }
+    static string timing(const char* name, double ms) {
+        ostringstream s;
+        s << fixed << setprecision(2) << name << " " << ms;
+        return s.str();
+    }
+    // Append "label item item ...", continuing on indented lines where the
+    // next item would run off the texture
+    static void wrap(vector<string>& lines, const string& label, const vector<string>& items) {
+        const size_t width = (HUD_W - 2) / HUD_GLYPH_W;
+        string line = label;
+        for (const string& item : items) {
+            if (line.size() + 1 + item.size() > width && line.size() > label.size()) {
+                lines.push_back(line);
+                line = string(label.size(), ' ');
+            }
+            line += " " + item;
+        }
+        lines.push_back(line);
+    }
+    void drawText(const string& text, int x, int y) {
+        for (char ch : text) {
+            const char* glyph = strchr(HUD_CHARS, toupper((unsigned char)ch));
+            if (glyph && *glyph) {
+                const unsigned char* rows = HUD_FONT[glyph - HUD_CHARS];
+                for (int row = 0; row < 7; ++row)
+                    for (int col = 0; col < 5; ++col) {
+                        if (!(rows[row] & (0x10 >> col))) continue;
+                        int px = x + col, py = y + row;
+                        if (px >= HUD_W || py >= HUD_H) continue;
+                        unsigned char* p = &hudPixels[(py * HUD_W + px) * 4];
+                        p[0] = p[1] = p[2] = p[3] = 255;
+                    }
+            }
+            x += HUD_GLYPH_W;
+        }
+    }
+
+    void initHud() {
+        const char* vertexShaderSource = R"(
+        #version 330 core
+        layout (location = 0) in vec2 aPos;
+        uniform vec4 rect; // xy = bottom-left in NDC, zw = size in NDC
+        out vec2 TexCoord;
+        void main() {
+            vec2 uv = aPos * 0.5 + 0.5;
+            gl_Position = vec4(rect.xy + uv * rect.zw, 0.0, 1.0);
+            TexCoord = vec2(uv.x, 1.0 - uv.y); // text rows are stored top-down
+        })";
+        const char* fragmentShaderSource = R"(
+        #version 330 core
+        in vec2 TexCoord;
+        out vec4 FragColor;
+        uniform sampler2D hudTexture;
+        void main() {
+            float a = texture(hudTexture, TexCoord).a;
+            FragColor = vec4(vec3(0.2, 1.0, 0.4), a);
+        })";
+        GLuint vs = glCreateShader(GL_VERTEX_SHADER);
+        glShaderSource(vs, 1, &vertexShaderSource, nullptr);
+        glCompileShader(vs);
+        GLuint fs = glCreateShader(GL_FRAGMENT_SHADER);
+        glShaderSource(fs, 1, &fragmentShaderSource, nullptr);
+        glCompileShader(fs);
+        GLuint program = glCreateProgram();
+        glAttachShader(program, vs);
+        glAttachShader(program, fs);
+        glLinkProgram(program);
+        hudProgram.resolve(program);
+        glDeleteShader(vs);
+        glDeleteShader(fs);
+
+        float quad[] = { -1,-1,  1,-1,  -1,1,  1,1 };
+        glGenVertexArrays(1, &hudVAO);
+        glGenBuffers(1, &hudVBO);
+        glstate::state().bindVertexArray(hudVAO);
+        glBindBuffer(GL_ARRAY_BUFFER, hudVBO);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(quad), quad, GL_STATIC_DRAW);
+        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), (void*)0);
+        glEnableVertexAttribArray(0);
+
+        hudPixels.assign(HUD_W * HUD_H * 4, 0);
+        glGenTextures(1, &hudTexture);
+        glstate::state().bindTexture(0, GL_TEXTURE_2D, hudTexture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, HUD_W, HUD_H, 0, GL_RGBA, GL_UNSIGNED_BYTE, hudPixels.data());
+    }
+    void drawHud(int winW, int winH) {
+        if (!ShowHud) return;
+        // 2x pixel scale in the top-left corner
+        float w = 2.0f * HUD_W * 2.0f / winW, h = 2.0f * HUD_H * 2.0f / winH;
+        glstate::State& gl = glstate::state();
+        gl.useProgram(hudProgram.id);
+        hudProgram.set("rect", vec4(-1.0f, 1.0f - h, w, h));
+        gl.bindTexture(0, GL_TEXTURE_2D, hudTexture);
+        hudProgram.set("hudTexture", 0);
+        gl.disable(GL_DEPTH_TEST);
+        gl.enable(GL_BLEND);
+        gl.blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        gl.bindVertexArray(hudVAO);
+        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    }
+};
+PerfStats perf;
+
 void setupCameraCallbacks(GLFWwindow* window) {
     glfwSetWindowUserPointer(window, &camera);
 
@@ -667,75 +1493,127 @@ void setupCameraCallbacks(GLFWwindow* window) {
 
 
 // -- MAIN -- //
-int main() {
+int main(int argc, char** argv) {
+    const char* perfCsvPath = nullptr;
+    const char* scenePath = nullptr;
+    const char* telemetryPath = nullptr;
+    const char* recordPath = nullptr;
+    const char* replayPath = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--perf-csv") == 0 && i + 1 < argc) perfCsvPath = argv[++i];
+        else if (strcmp(argv[i], "--scene") == 0 && i + 1 < argc) scenePath = argv[++i];
+        else if (strcmp(argv[i], "--telemetry") == 0 && i + 1 < argc) telemetryPath = argv[++i];
+        else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) recordPath = argv[++i];
+        else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) replayPath = argv[++i];
+        else if (strcmp(argv[i], "--grid-tolerance") == 0 && i + 1 < argc) engine.gridTree.setTolerance(float(atof(argv[++i])));
+    }
+    if (scenePath && !loadScene(scenePath)) return 1;
+    // binary event log, see telemetry.h; convert with telemetry_csv
+    const uint16_t frameEvent = telemetry::define("frame", "ms", "rays");
+    const uint16_t driftEvent = telemetry::define("energy.drift", "relative", "sim_s", 1.0);
+    physics.tickEvent = telemetry::define("physics.tick", "ms", "bodies");
+    const uint16_t glEvent = telemetry::define("gl.calls", "issued", "elided");
+    recorder.frameEvent = telemetry::define("record.frame", "bytes", "keyframe");
+    if (telemetryPath && !telemetry::start(telemetryPath))
+        cerr << "[WARN] Could not open telemetry log: " << telemetryPath << "\n";
     setupCameraCallbacks(engine.window);
+    perf.init(perfCsvPath);
+    if (replayPath) {
+        string error;
+        if (!replay.open(replayPath, error)) {
+            cerr << "[ERROR] " << error << endl;
+            return 1;
+        }
+        replaying = true;
+    } else {
+        if (recordPath) {
+            if (recorder.open(recordPath, PHYSICS_HZ, RECORD_POSITION_STEP, RECORD_VELOCITY_STEP))
+                physics.onPublish = [](const sim::Snapshot& s) { recorder.push(s); };
+            else
+                cerr << "[WARN] Could not open recording: " << recordPath << "\n";
+        }
+        startPhysics(objects, scenePath ? &sceneFile : nullptr);
+    }
     vector<unsigned char> pixels(engine.WIDTH * engine.HEIGHT * 3);
 
     auto t0 = Clock::now();
     lastPrintTime = chrono::duration<double>(t0.time_since_epoch()).count();
 
-    double lastTime = glfwGetTime();
+    double lastFrame = glfwGetTime();
     int   renderW  = 800, renderH = 600, numSteps = 80000;
     while (!glfwWindowShouldClose(engine.window)) {
         glClearColor(0.0f, 0.0f, 0.0f, 1.0f);  // optional, but good practice
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
         double now   = glfwGetTime();
-        double dt    = now - lastTime;   // seconds since last frame
-        lastTime     = now;
-
-        // Gravity
-        for (auto& obj : objects) {
-            for (auto& obj2 : objects) {
-                if (&obj == &obj2) continue; // skip self-interaction
-                 float dx  = obj2.posRadius.x - obj.posRadius.x;
-                 float dy = obj2.posRadius.y - obj.posRadius.y;
-                 float dz = obj2.posRadius.z - obj.posRadius.z;
-                 float distance = sqrt(dx * dx + dy * dy + dz * dz);
-                 if (distance > 0) {
-                        vector<double> direction = {dx / distance, dy / distance, dz / distance};
-                        //distance *= 1000;
-                        double Gforce = (G * obj.mass * obj2.mass) / (distance * distance);
-
-                        double acc1 = Gforce / obj.mass;
-                        std::vector<double> acc = {direction[0] * acc1, direction[1] * acc1, direction[2] * acc1};
-                        if (Gravity) {
-                            obj.velocity.x += acc[0];
-                            obj.velocity.y += acc[1];
-                            obj.velocity.z += acc[2];
-
-                            obj.posRadius.x += obj.velocity.x;
-                            obj.posRadius.y += obj.velocity.y;
-                            obj.posRadius.z += obj.velocity.z;
-                            cout << "velocity: " <<obj.velocity.x<<", " <<obj.velocity.y<<", " <<obj.velocity.z<<endl;
-                        }
-                    }
-            }
-        }
+        perf.beginCpu();
 
+        // Gravity: runs on the physics thread, we only read its latest state
+        if (replaying) {
+            readReplay(objects, now - lastFrame);
+        } else {
+            physics.setPaused(!Gravity);
+            physics.setSolver(GravitySolver);
+            readPhysics(objects, sim::wallSeconds());
+        }
 
+        perf.endCpu(CPU_PHYSICS);
 
         // ---------- GRID ------------- //
-        // 2) rebuild grid mesh on CPU
-        engine.generateGrid(objects);
+        // 2) refresh the grid's well buffer if any object moved or changed mass
+        engine.updateGrid(objects, camera);
 
         // Restore interactive camera controls for mouse movement
         camera.update();
         mat4 view = lookAt(camera.position(), camera.target, vec3(0,1,0));
         mat4 proj = perspective(radians(90.0f), float(engine.WIDTH)/engine.HEIGHT, 1e11f, 1e14f);
         mat4 viewProj = proj * view;
+        perf.beginGpu(GPU_GRID);
         engine.drawGrid(viewProj);
+        perf.endGpu(GPU_GRID);
+        perf.endCpu(CPU_GRID);
 
         // ---------- RUN RAYTRACER ------------- //
         glViewport(0, 0, engine.WIDTH, engine.HEIGHT);
-        // engine.dispatchCompute(camera); // Disabled for macOS compatibility
+        if (engine.computeProgram) {
+            perf.beginGpu(GPU_COMPUTE);
+            if (engine.dispatchCompute(camera))
+                perf.raysThisFrame = (long long)engine.traceWidth * engine.traceHeight;
+            perf.endGpu(GPU_COMPUTE);
+        }
+        perf.endCpu(CPU_COMPUTE);
+        perf.beginGpu(GPU_QUAD);
         engine.drawFullScreenQuad();
+        perf.endGpu(GPU_QUAD);
+        perf.drawHud(engine.WIDTH, engine.HEIGHT);
+        perf.endCpu(CPU_QUAD);
 
         // 6) present to screen
         glfwSwapBuffers(engine.window);
         glfwPollEvents();
+        perf.endCpu(CPU_PRESENT);
+        telemetry::log(frameEvent, (now - lastFrame) * 1e3, double(perf.raysThisFrame));
+        telemetry::log(driftEvent, physics.latest().energyDrift, physics.latest().time);
+        lastFrame = now;
+        perf.endFrame(now);
+        telemetry::log(glEvent, perf.glCalls.issued, perf.glCalls.elided);
+
+        // FPS + HUD refresh once per second
+        framesCount++;
+        double wall = chrono::duration<double>(Clock::now().time_since_epoch()).count();
+        if (wall - lastPrintTime >= 1.0) {
+            perf.energyDrift = physics.latest().energyDrift;
+            perf.updateHud(framesCount / (wall - lastPrintTime));
+            framesCount   = 0;
+            lastPrintTime = wall;
+        }
     }
 
+    physics.stop();
+    recorder.close();
+    if (recorder.droppedFrames())
+        cerr << "[WARN] Recording dropped " << recorder.droppedFrames() << " ticks\n";
+    telemetry::stop();
     glfwDestroyWindow(engine.window);
     glfwTerminate();
     return 0;
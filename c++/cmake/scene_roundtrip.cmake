@@ -0,0 +1,29 @@
+# Scene round trip, run by ctest: converts a text scene (or a --disc N scene)
+# to binary, dumps it back to text, converts that again, and requires the two
+# binary files to be identical, so --dump loses nothing.
+#
+#   cmake -DSCENE_CONVERT=<exe> -DSCENE=<scene.txt> -DWORK=<file prefix> -P scene_roundtrip.cmake
+#   cmake -DSCENE_CONVERT=<exe> -DDISC=<bodies> -DWORK=<file prefix> -P scene_roundtrip.cmake
+
+if(DEFINED DISC)
+    set(first_args --disc ${DISC} ${WORK}.bhs)
+else()
+    set(first_args ${SCENE} ${WORK}.bhs)
+endif()
+
+execute_process(COMMAND ${SCENE_CONVERT} ${first_args} RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "scene_convert ${first_args} failed")
+endif()
+execute_process(COMMAND ${SCENE_CONVERT} --dump ${WORK}.bhs OUTPUT_FILE ${WORK}.txt RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "scene_convert --dump ${WORK}.bhs failed")
+endif()
+execute_process(COMMAND ${SCENE_CONVERT} ${WORK}.txt ${WORK}.again.bhs RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "scene_convert could not read back its own dump ${WORK}.txt")
+endif()
+execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files ${WORK}.bhs ${WORK}.again.bhs RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "${WORK}.bhs changed on the way through --dump")
+endif()
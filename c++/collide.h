@@ -0,0 +1,231 @@
+// collide.h - collision detection and merging for N-body bodies
+//
+// Broad phase is a uniform spatial hash rebuilt on every call. Each body is
+// entered in every cell its bounding box touches, so overlapping bodies share
+// a cell and the narrow phase only pairs up entries of the same cell. A pair
+// is kept only in the cell holding the low corner of the two boxes'
+// intersection, so it is found once however many cells the two share.
+// The cell size follows the mean radius but is at least a quarter of the
+// largest, which keeps the entries per body bounded (at most 10^3). Building
+// is linear in the entries and the narrow phase looks at only the bodies
+// sharing a cell, so the cost is O(N) for any sensible spread of sizes.
+//
+// Overlapping spheres merge: every connected group of overlaps becomes its
+// heaviest member with the group's total mass, centre of mass and momentum,
+// and the group's total volume (r^3 sums). Bodies with radius 0 are points
+// and never touch anything.
+//
+// The narrow phase runs in parallel with OpenMP when it is enabled, through
+// nbody.h's NBODY_OMP.
+#pragma once
+
+#include "nbody.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+namespace collide {
+
+class Merger {
+public:
+    size_t entries = 0;         // cell entries in the last build
+    size_t pairs = 0;           // overlapping pairs found by the last merge()
+
+    // Merge overlapping bodies in place. radius and ids are parallel to the
+    // bodies and are compacted with them; order is kept, so sorted ids stay
+    // sorted. Returns the number of bodies removed.
+    size_t merge(nbody::Bodies& b, std::vector<double>& radius, std::vector<uint32_t>& ids) {
+        const size_t n = b.size();
+        pairs = 0;
+        entries = 0;
+        if (n < 2) return 0;
+        double sum = 0.0, largest = 0.0;
+        for (size_t i = 0; i < n; ++i) {
+            sum += radius[i];
+            largest = std::max(largest, radius[i]);
+        }
+        if (largest <= 0.0) return 0;
+        cell = std::max(2.0 * sum / double(n), 0.25 * largest);
+        invCell = 1.0 / cell;
+
+        build(b, radius);
+        findPairs(b, radius);
+        if (found.empty()) return 0;
+        pairs = found.size();
+        return mergeGroups(b, radius, ids);
+    }
+
+private:
+    struct Entry {
+        uint64_t cell;          // packed cell coordinates, see key()
+        uint32_t body;
+    };
+    struct Range {
+        int64_t lo[3], hi[3];
+    };
+
+    double cell = 1.0, invCell = 1.0;
+    std::vector<Range> ranges;          // per body
+    std::vector<size_t> firstEntry;     // per body, then the total
+    std::vector<Entry> unsorted, sorted;
+    std::vector<uint32_t> bucketOf;
+    std::vector<uint32_t> bucketStart;  // tableSize + 1
+    size_t mask = 0;
+    std::vector<std::pair<uint32_t, uint32_t>> found;
+    std::vector<uint32_t> parent;
+    std::vector<double> total;          // per group root: m, m x, m v, r^3
+    std::vector<uint32_t> members, heaviest;
+    std::vector<char> removed;
+
+    int64_t cellOf(double v) const { return int64_t(std::floor(v * invCell)); }
+    // 21 bits per axis; cells that alias are far apart and fail the sphere test
+    static uint64_t key(int64_t cx, int64_t cy, int64_t cz) {
+        const uint64_t m = (1u << 21) - 1;
+        return (uint64_t(cx) & m) | (uint64_t(cy) & m) << 21 | (uint64_t(cz) & m) << 42;
+    }
+    size_t bucket(uint64_t k) const {
+        k *= 0x9E3779B97F4A7C15ull;
+        return size_t(k ^ (k >> 31)) & mask;
+    }
+
+    void build(const nbody::Bodies& b, const std::vector<double>& radius) {
+        const size_t n = b.size();
+        ranges.resize(n);
+        firstEntry.resize(n + 1);
+        firstEntry[0] = 0;
+        for (size_t i = 0; i < n; ++i) {
+            const double p[3] = { b.x[i], b.y[i], b.z[i] };
+            Range& r = ranges[i];
+            size_t count = 1;
+            for (int a = 0; a < 3; ++a) {
+                r.lo[a] = cellOf(p[a] - radius[i]);
+                r.hi[a] = cellOf(p[a] + radius[i]);
+                count *= size_t(r.hi[a] - r.lo[a] + 1);
+            }
+            firstEntry[i + 1] = firstEntry[i] + count;
+        }
+        entries = firstEntry[n];
+        size_t tableSize = 1;
+        while (tableSize < entries) tableSize <<= 1;
+        mask = tableSize - 1;
+
+        unsorted.resize(entries);
+        bucketOf.resize(entries);
+        NBODY_OMP(omp parallel for schedule(static))
+        for (long long i = 0; i < (long long)n; ++i) {
+            const Range& r = ranges[i];
+            size_t e = firstEntry[i];
+            for (int64_t cz = r.lo[2]; cz <= r.hi[2]; ++cz)
+                for (int64_t cy = r.lo[1]; cy <= r.hi[1]; ++cy)
+                    for (int64_t cx = r.lo[0]; cx <= r.hi[0]; ++cx, ++e) {
+                        unsorted[e] = Entry{ key(cx, cy, cz), uint32_t(i) };
+                        bucketOf[e] = uint32_t(bucket(unsorted[e].cell));
+                    }
+        }
+
+        // counting sort of the entries by bucket
+        bucketStart.assign(tableSize + 1, 0);
+        for (size_t e = 0; e < entries; ++e) bucketStart[bucketOf[e] + 1]++;
+        for (size_t k = 0; k < tableSize; ++k) bucketStart[k + 1] += bucketStart[k];
+        sorted.resize(entries);
+        for (size_t e = 0; e < entries; ++e) sorted[bucketStart[bucketOf[e]]++] = unsorted[e];
+        for (size_t k = tableSize; k > 0; --k) bucketStart[k] = bucketStart[k - 1];
+        bucketStart[0] = 0;
+    }
+
+    // Every body is in every cell it touches, so overlapping bodies always
+    // share a cell and only entries within one bucket need testing
+    void findPairs(const nbody::Bodies& b, const std::vector<double>& radius) {
+        found.clear();
+        const long long buckets = (long long)mask + 1;
+        NBODY_OMP(omp parallel)
+        {
+            std::vector<std::pair<uint32_t, uint32_t>> local;
+            NBODY_OMP(omp for schedule(dynamic, 4096) nowait)
+            for (long long k = 0; k < buckets; ++k) {
+                const uint32_t end = bucketStart[k + 1];
+                for (uint32_t e = bucketStart[k]; e + 1 < end; ++e) {
+                    const Entry& a = sorted[e];
+                    const size_t i = a.body;
+                    for (uint32_t f = e + 1; f < end; ++f) {
+                        const Entry& c = sorted[f];
+                        if (c.cell != a.cell) continue;
+                        const size_t j = c.body;
+                        const double dx = b.x[j] - b.x[i], dy = b.y[j] - b.y[i], dz = b.z[j] - b.z[i];
+                        const double reach = radius[i] + radius[j];
+                        if (dx * dx + dy * dy + dz * dz >= reach * reach) continue;
+                        // count the pair only in the cell of the boxes' common low corner
+                        if (key(cellOf(std::max(b.x[i] - radius[i], b.x[j] - radius[j])),
+                                cellOf(std::max(b.y[i] - radius[i], b.y[j] - radius[j])),
+                                cellOf(std::max(b.z[i] - radius[i], b.z[j] - radius[j]))) != a.cell) continue;
+                        local.push_back(std::make_pair(uint32_t(std::min(i, j)), uint32_t(std::max(i, j))));
+                    }
+                }
+            }
+            NBODY_OMP(omp critical)
+            found.insert(found.end(), local.begin(), local.end());
+        }
+    }
+
+    uint32_t root(uint32_t i) {
+        while (parent[i] != i) i = parent[i] = parent[parent[i]];
+        return i;
+    }
+
+    size_t mergeGroups(nbody::Bodies& b, std::vector<double>& radius, std::vector<uint32_t>& ids) {
+        const size_t n = b.size();
+        parent.resize(n);
+        for (size_t i = 0; i < n; ++i) parent[i] = uint32_t(i);
+        for (const auto& p : found) {
+            uint32_t a = root(p.first), c = root(p.second);
+            if (a != c) parent[std::max(a, c)] = std::min(a, c);
+        }
+
+        // sums per group, over the bodies that touch something
+        const int FIELDS = 8;   // m, m x, m y, m z, m vx, m vy, m vz, r^3
+        total.assign(FIELDS * n, 0.0);
+        heaviest.assign(n, UINT32_MAX);
+        removed.assign(n, 0);
+        members.clear();
+        for (const auto& p : found) { members.push_back(p.first); members.push_back(p.second); }
+        std::sort(members.begin(), members.end());
+        members.erase(std::unique(members.begin(), members.end()), members.end());
+        for (uint32_t i : members) {
+            const uint32_t g = root(i);
+            double* t = &total[FIELDS * g];
+            const double m = b.m[i];
+            t[0] += m;
+            t[1] += m * b.x[i]; t[2] += m * b.y[i]; t[3] += m * b.z[i];
+            t[4] += m * b.vx[i]; t[5] += m * b.vy[i]; t[6] += m * b.vz[i];
+            t[7] += radius[i] * radius[i] * radius[i];
+            if (heaviest[g] == UINT32_MAX || m > b.m[heaviest[g]]) heaviest[g] = i;
+        }
+        for (uint32_t i : members) {
+            const uint32_t g = root(i);
+            if (heaviest[g] != i) { removed[i] = 1; continue; }
+            const double* t = &total[FIELDS * g];
+            if (t[0] > 0.0) {
+                b.x[i] = t[1] / t[0]; b.y[i] = t[2] / t[0]; b.z[i] = t[3] / t[0];
+                b.vx[i] = t[4] / t[0]; b.vy[i] = t[5] / t[0]; b.vz[i] = t[6] / t[0];
+            }
+            b.m[i] = t[0];
+            radius[i] = std::cbrt(t[7]);
+        }
+
+        size_t out = 0;
+        for (size_t i = 0; i < n; ++i) {
+            if (removed[i]) continue;
+            for (auto* v : { &b.x, &b.y, &b.z, &b.vx, &b.vy, &b.vz, &b.ax, &b.ay, &b.az, &b.m }) (*v)[out] = (*v)[i];
+            radius[out] = radius[i];
+            ids[out] = ids[i];
+            out++;
+        }
+        b.resize(out);
+        radius.resize(out);
+        ids.resize(out);
+        return n - out;
+    }
+};
+
+} // namespace collide
@@ -0,0 +1,220 @@
+// gl_state.h - cached GL bindings and uniform locations
+//
+// The render loops used to look every uniform up by name each frame and to
+// rebind programs, VAOs and textures and toggle enable bits whether or not
+// anything had changed. Program resolves the location of each active
+// uniform once, right after linking, and keeps the last value sent to it,
+// so setting an unchanged uniform costs a compare and no GL call. State
+// mirrors the bindings the renderers touch and drops calls that would set
+// what is already set. Passes say what they need rather than restoring
+// what they changed, so the steady state of a frame is mostly elided calls.
+//
+// Every change to tracked state has to go through state(); code that
+// changes it behind the cache's back (or deletes a bound object) must call
+// State::invalidate(). Both classes count issued and elided calls, and
+// State::endFrame() returns and clears the counts for the frame.
+#pragma once
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/type_ptr.hpp>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace glstate {
+
+struct Stats {
+    unsigned issued = 0;
+    unsigned elided = 0;
+};
+
+class State {
+public:
+    static const int TEXTURE_UNITS = 16;
+    static const GLuint UNKNOWN = ~0u;
+
+    State() { invalidate(); }
+
+    // Forget everything; the next call of each kind is issued
+    void invalidate() {
+        program = UNKNOWN;
+        vertexArray = UNKNOWN;
+        activeUnit = UNKNOWN;
+        for (int u = 0; u < TEXTURE_UNITS; ++u) textures[u] = Binding();
+        caps.clear();
+        blendSrc = blendDst = UNKNOWN;
+    }
+
+    void useProgram(GLuint p) {
+        if (!changed(program, p)) return;
+        glUseProgram(p);
+    }
+    GLuint currentProgram() const { return program; }
+
+    void bindVertexArray(GLuint vao) {
+        if (!changed(vertexArray, vao)) return;
+        glBindVertexArray(vao);
+    }
+
+    // Selects the unit only if the binding actually changes
+    void bindTexture(GLuint unit, GLenum target, GLuint texture) {
+        Binding& b = textures[unit];
+        if (b.target == target && b.texture == texture) { stats.elided++; return; }
+        if (activeUnit != unit) {
+            glActiveTexture(GL_TEXTURE0 + unit);
+            activeUnit = unit;
+            stats.issued++;
+        }
+        glBindTexture(target, texture);
+        b.target = target;
+        b.texture = texture;
+        stats.issued++;
+    }
+
+    void enable(GLenum cap) { set(cap, true); }
+    void disable(GLenum cap) { set(cap, false); }
+
+    void blendFunc(GLenum src, GLenum dst) {
+        if (blendSrc == src && blendDst == dst) { stats.elided++; return; }
+        glBlendFunc(src, dst);
+        blendSrc = src;
+        blendDst = dst;
+        stats.issued++;
+    }
+
+    Stats stats;
+
+    Stats endFrame() {
+        Stats frame = stats;
+        stats = Stats();
+        return frame;
+    }
+
+private:
+    struct Binding {
+        GLenum target = 0;
+        GLuint texture = UNKNOWN;
+    };
+    struct Cap {
+        GLenum cap;
+        bool on;
+    };
+
+    GLuint program, vertexArray, activeUnit;
+    Binding textures[TEXTURE_UNITS];
+    std::vector<Cap> caps;      // only the few the renderers touch
+    GLenum blendSrc, blendDst;
+
+    bool changed(GLuint& cached, GLuint value) {
+        if (cached == value) { stats.elided++; return false; }
+        cached = value;
+        stats.issued++;
+        return true;
+    }
+    void set(GLenum cap, bool on) {
+        for (auto& c : caps) {
+            if (c.cap != cap) continue;
+            if (c.on == on) { stats.elided++; return; }
+            c.on = on;
+            issue(cap, on);
+            return;
+        }
+        caps.push_back({ cap, on });
+        issue(cap, on);
+    }
+    void issue(GLenum cap, bool on) {
+        if (on) glEnable(cap);
+        else glDisable(cap);
+        stats.issued++;
+    }
+};
+
+inline State& state() {
+    static State s;
+    return s;
+}
+
+class Program {
+public:
+    GLuint id = 0;
+
+    // Take a linked program and resolve all of its active uniforms
+    void resolve(GLuint program) {
+        id = program;
+        uniforms.clear();
+        GLint count = 0;
+        glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &count);
+        for (GLint i = 0; i < count; ++i) {
+            char name[128];
+            GLsizei length = 0;
+            GLint size = 0;
+            GLenum type = 0;
+            glGetActiveUniform(program, GLuint(i), sizeof(name), &length, &size, &type, name);
+            Uniform u;
+            u.location = glGetUniformLocation(program, name);
+            if (u.location < 0) continue;       // block members
+            u.name.assign(name, length);
+            // arrays are reported as "name[0]"
+            if (u.name.size() > 3 && u.name.compare(u.name.size() - 3, 3, "[0]") == 0)
+                u.name.resize(u.name.size() - 3);
+            uniforms.push_back(u);
+        }
+    }
+
+    // -1 if the linker dropped it
+    GLint location(const char* name) const {
+        const Uniform* u = find(name);
+        return u ? u->location : -1;
+    }
+
+    // Setters make the program current; unknown names are ignored like location -1
+    void set(const char* name, GLint v) {
+        if (Uniform* u = update(name, &v, sizeof(v))) glUniform1i(u->location, v);
+    }
+    void set(const char* name, float v) {
+        if (Uniform* u = update(name, &v, sizeof(v))) glUniform1f(u->location, v);
+    }
+    void set(const char* name, const glm::vec2& v) {
+        if (Uniform* u = update(name, &v, sizeof(v))) glUniform2fv(u->location, 1, glm::value_ptr(v));
+    }
+    void set(const char* name, const glm::vec4& v) {
+        if (Uniform* u = update(name, &v, sizeof(v))) glUniform4fv(u->location, 1, glm::value_ptr(v));
+    }
+    void set(const char* name, const glm::mat4& v) {
+        if (Uniform* u = update(name, &v, sizeof(v))) glUniformMatrix4fv(u->location, 1, GL_FALSE, glm::value_ptr(v));
+    }
+
+private:
+    struct Uniform {
+        std::string name;
+        GLint location = -1;
+        unsigned char value[sizeof(glm::mat4)];
+        size_t size = 0;                // bytes in value; 0 until first set
+    };
+    std::vector<Uniform> uniforms;      // a handful per program, searched linearly
+
+    const Uniform* find(const char* name) const {
+        for (const auto& u : uniforms)
+            if (u.name == name) return &u;
+        return nullptr;
+    }
+
+    // The uniform to upload, or null if it is unknown or already holds value
+    Uniform* update(const char* name, const void* value, size_t size) {
+        Uniform* u = const_cast<Uniform*>(find(name));
+        if (!u) return nullptr;
+        State& s = state();
+        if (u->size == size && std::memcmp(u->value, value, size) == 0) {
+            s.stats.elided++;
+            return nullptr;
+        }
+        std::memcpy(u->value, value, size);
+        u->size = size;
+        if (s.currentProgram() != id) s.useProgram(id);
+        s.stats.issued++;
+        return u;
+    }
+};
+
+} // namespace glstate
@@ -0,0 +1,127 @@
+// nbody_bench.cpp - scaling benchmark for the solvers in nbody.h
+//
+// For N = 1e3, 1e4, ... up to --max, builds a random Plummer sphere and times
+// one force evaluation per solver, and per expansion order for the FMM.
+// Accuracy is reported as percentiles of the relative force error against
+// the direct sum, sampled on a subset of bodies so the reference stays
+// affordable at large N. Pick the cheapest order whose p99 meets the
+// tolerance. The direct sum also reports GFLOP/s, counting the customary
+// 20 flops per pair interaction.
+//
+//   ./nbody_bench [--max N] [--theta T] [--fmm-theta T] [--orders 2,4,6,8] [--samples S]
+#include "nbody.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <algorithm>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+static void plummerSphere(nbody::Bodies& b, size_t n, unsigned seed) {
+    std::mt19937_64 rng(seed);
+    std::uniform_real_distribution<double> U(0.0, 1.0);
+    const double a = 1e11, totalMass = 2e30 * 1e3;
+    b.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+        double r = a / std::sqrt(std::pow(std::max(U(rng), 1e-12), -2.0 / 3.0) - 1.0);
+        r = std::min(r, 50.0 * a);
+        double ct = 2.0 * U(rng) - 1.0, st = std::sqrt(1.0 - ct * ct), ph = 2.0 * M_PI * U(rng);
+        b.x[i] = r * st * std::cos(ph);
+        b.y[i] = r * st * std::sin(ph);
+        b.z[i] = r * ct;
+        b.vx[i] = b.vy[i] = b.vz[i] = 0.0;
+        b.m[i] = totalMass / n;
+    }
+}
+
+// Exact acceleration on body i, used as the reference for sampled errors
+static void directOn(const nbody::Bodies& b, size_t i, const nbody::Config& cfg, double a[3]) {
+    const double eps2 = cfg.softening * cfg.softening;
+    double s[3] = { 0.0, 0.0, 0.0 };
+    for (size_t j = 0; j < b.size(); ++j) {
+        if (j == i) continue;
+        double dx = b.x[j] - b.x[i], dy = b.y[j] - b.y[i], dz = b.z[j] - b.z[i];
+        double r2 = dx * dx + dy * dy + dz * dz + eps2;
+        double w = b.m[j] / (r2 * std::sqrt(r2));
+        s[0] += dx * w; s[1] += dy * w; s[2] += dz * w;
+    }
+    for (int k = 0; k < 3; ++k) a[k] = cfg.G * s[k];
+}
+
+int main(int argc, char** argv) {
+    size_t maxN = 1000000;
+    double theta = 0.5;
+    double fmmTheta = 0.7;
+    std::vector<int> orders = { 2, 4, 6, 8 };
+    size_t samples = 1000;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--max") == 0 && i + 1 < argc) maxN = size_t(atof(argv[++i]));
+        else if (strcmp(argv[i], "--theta") == 0 && i + 1 < argc) theta = atof(argv[++i]);
+        else if (strcmp(argv[i], "--fmm-theta") == 0 && i + 1 < argc) fmmTheta = atof(argv[++i]);
+        else if (strcmp(argv[i], "--samples") == 0 && i + 1 < argc) samples = size_t(atoi(argv[++i]));
+        else if (strcmp(argv[i], "--orders") == 0 && i + 1 < argc) {
+            orders.clear();
+            for (char* tok = strtok(argv[++i], ","); tok; tok = strtok(nullptr, ",")) orders.push_back(atoi(tok));
+        } else {
+            fprintf(stderr, "usage: %s [--max N] [--theta T] [--fmm-theta T] [--orders 2,4,6,8] [--samples S]\n", argv[0]);
+            return 1;
+        }
+    }
+    const size_t DIRECT_MAX = 50000; // beyond this the O(N^2) timing is skipped
+
+    printf("%10s  %-11s %5s %12s %14s %9s %10s %10s %10s %10s\n",
+           "N", "solver", "order", "ms/eval", "bodies/s", "GFLOP/s", "err p50", "err p90", "err p99", "err max");
+    for (size_t n = 1000; n <= maxN; n *= 10) {
+        nbody::System sys;
+        sys.config.softening = 1e9;
+        sys.config.theta = theta;
+        sys.config.fmmTheta = fmmTheta;
+        plummerSphere(sys.bodies, n, 1234);
+
+        // reference accelerations on a fixed sample of bodies
+        size_t ns = std::min(samples, n);
+        std::vector<double> ref(3 * ns);
+        for (size_t s = 0; s < ns; ++s) directOn(sys.bodies, s * (n / ns), sys.config, &ref[3 * s]);
+
+        // one run per solver, and per order for the FMM
+        std::vector<std::pair<nbody::Solver, int>> runs;
+        for (int k = 0; k < int(nbody::Solver::Count); ++k) {
+            nbody::Solver solver = nbody::Solver(k);
+            if (solver == nbody::Solver::Direct && n > DIRECT_MAX) continue;
+            if (solver == nbody::Solver::FMM) {
+                for (int p : orders) runs.push_back(std::make_pair(solver, p));
+            } else {
+                runs.push_back(std::make_pair(solver, 0));
+            }
+        }
+        std::vector<double> errs(ns);
+        for (const auto& run : runs) {
+            sys.config.solver = run.first;
+            sys.config.order = run.second;
+            sys.computeAccelerations(); // warm-up, sizes the scratch buffers
+            auto t0 = Clock::now();
+            sys.computeAccelerations();
+            double ms = std::chrono::duration<double, std::milli>(Clock::now() - t0).count();
+
+            for (size_t s = 0; s < ns; ++s) {
+                size_t i = s * (n / ns);
+                const double* r = &ref[3 * s];
+                double ex = sys.bodies.ax[i] - r[0], ey = sys.bodies.ay[i] - r[1], ez = sys.bodies.az[i] - r[2];
+                errs[s] = std::sqrt((ex * ex + ey * ey + ez * ez) / (r[0] * r[0] + r[1] * r[1] + r[2] * r[2]));
+            }
+            std::sort(errs.begin(), errs.end());
+            auto pct = [&](double q) { return errs[std::min(ns - 1, size_t(q * ns))]; };
+            char order[8] = "-";
+            if (run.second) snprintf(order, sizeof(order), "%d", run.second);
+            char gflops[16] = "-";
+            if (run.first == nbody::Solver::Direct) snprintf(gflops, sizeof(gflops), "%.1f", 20.0 * n * n / (ms * 1e6));
+            printf("%10zu  %-11s %5s %12.2f %14.3e %9s %10.2e %10.2e %10.2e %10.2e\n", n, nbody::solverName(run.first),
+                   order, ms, n / (ms * 1e-3), gflops, pct(0.5), pct(0.9), pct(0.99), errs[ns - 1]);
+            fflush(stdout);
+        }
+    }
+    return 0;
+}
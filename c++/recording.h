@@ -0,0 +1,457 @@
+// recording.h - compact record of a run's body state, for offline replay
+//
+// Writer takes every snapshot the physics thread publishes (hook it up as
+// sim::PhysicsThread::onPublish). push() only copies the arrays into a free
+// slot; a background thread encodes and writes them, so neither the physics
+// nor the render thread waits on the disk. If the writer falls behind,
+// snapshots are dropped rather than queued without bound.
+//
+// Positions and velocities are quantised to a fixed step, so a replayed value
+// is within half a step of the recorded one and errors do not accumulate.
+// Every KEY_INTERVAL frames, and whenever the body set, a mass or a radius
+// changes, a keyframe stores the quantised values outright; the frames in
+// between store only the change of each since the frame before, as zigzag
+// varints (one or two bytes for a body that moved a few steps). The index of
+// keyframes at the end lets Reader seek to any tick by decoding at most
+// KEY_INTERVAL frames. A file without an index (the program was killed) is
+// still readable; Reader rebuilds the index by scanning.
+//
+// File layout (little-endian):
+//   Header (64 bytes, below)
+//   records: u32 byte count of the rest of the record, u8 kind (KEY, DELTA),
+//            u8[3] zero, u64 tick, f64 time (simulated s), u32 body count N;
+//            KEY:   u32 id[N], f64 mass[N], f64 radius[N], then varints of
+//                   the quantised x[N], y[N], z[N], vx[N], vy[N], vz[N]
+//            DELTA: varints of the differences of the same six channels
+//   index:   char[8] "BHRECIDX", u64 count, count x { u64 tick, f64 time, u64 offset }
+//   trailer: u64 offset of the index, char[8] "BHRECEND"
+#pragma once
+
+#include "scene.h"
+#include "sim_thread.h"
+#include "telemetry.h"
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace recording {
+
+static const uint32_t VERSION = 1;
+static const char MAGIC[8] = { 'B', 'H', 'R', 'E', 'C', 'R', 'D', 0 };
+static const char INDEX_MAGIC[8] = { 'B', 'H', 'R', 'E', 'C', 'I', 'D', 'X' };
+static const char END_MAGIC[8] = { 'B', 'H', 'R', 'E', 'C', 'E', 'N', 'D' };
+static const int KEY_INTERVAL = 64;
+static const int CHANNELS = 6;      // x, y, z, vx, vy, vz
+
+enum Kind : uint8_t { KEY = 0, DELTA = 1 };
+
+struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved0;
+    double ticksPerSecond;      // physics rate of the recorded run
+    double positionStep;        // quantisation step, m
+    double velocityStep;        // quantisation step, m/s
+    char reserved[24];
+};
+static_assert(sizeof(Header) == 64, "recording header must stay 64 bytes");
+
+struct IndexEntry {
+    uint64_t tick;
+    double time;
+    uint64_t offset;
+};
+
+inline void putVarint(std::vector<uint8_t>& out, int64_t v) {
+    uint64_t z = (uint64_t(v) << 1) ^ uint64_t(v >> 63);
+    while (z >= 0x80) {
+        out.push_back(uint8_t(z) | 0x80);
+        z >>= 7;
+    }
+    out.push_back(uint8_t(z));
+}
+inline bool getVarint(const uint8_t*& p, const uint8_t* end, int64_t& v) {
+    uint64_t z = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t b = *p++;
+        z |= uint64_t(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            v = int64_t(z >> 1) ^ -int64_t(z & 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+class Writer {
+public:
+    static const int SLOTS = 8;
+    int frameEvent = -1;        // telemetry event per written frame (bytes, kind), -1 for none
+    bool lossless = false;      // push() waits for a free slot instead of dropping (offline runs)
+
+    ~Writer() { close(); }
+
+    bool open(const char* path, double ticksPerSecond, double positionStep, double velocityStep) {
+        close();
+        file = fopen(path, "wb");
+        if (!file) return false;
+        Header h = {};
+        memcpy(h.magic, MAGIC, sizeof(MAGIC));
+        h.version = VERSION;
+        h.ticksPerSecond = ticksPerSecond;
+        h.positionStep = positionStep;
+        h.velocityStep = velocityStep;
+        fwrite(&h, sizeof(h), 1, file);
+        offset = sizeof(h);
+        step[0] = step[1] = step[2] = positionStep;
+        step[3] = step[4] = step[5] = velocityStep;
+        index.clear();
+        sinceKey = KEY_INTERVAL;
+        lastIds.clear();
+        dropped = 0;
+        free.clear();
+        ready.clear();
+        for (int i = 0; i < SLOTS; ++i) free.push_back(i);
+        running = true;
+        worker = std::thread([this]() { run(); });
+        return true;
+    }
+
+    // Any one thread. Copies s; drops it if every slot is still queued,
+    // unless lossless is set.
+    void push(const sim::Snapshot& s) {
+        int slot;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (!running) return;
+            if (lossless) freed.wait(lock, [this]() { return !free.empty(); });
+            else if (free.empty()) { dropped++; return; }
+            slot = free.back();
+            free.pop_back();
+        }
+        sim::Snapshot& d = slots[slot];
+        d.tick = s.tick;
+        d.time = s.time;
+        d.id = s.id;
+        d.x = s.x; d.y = s.y; d.z = s.z;
+        d.vx = s.vx; d.vy = s.vy; d.vz = s.vz;
+        d.m = s.m;
+        d.r = s.r;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ready.push_back(slot);
+        }
+        wake.notify_one();
+    }
+
+    // Writes what is queued, then the index
+    void close() {
+        if (!file) return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            running = false;
+        }
+        wake.notify_one();
+        if (worker.joinable()) worker.join();
+        const uint64_t indexOffset = offset;
+        const uint64_t count = index.size();
+        fwrite(INDEX_MAGIC, sizeof(INDEX_MAGIC), 1, file);
+        fwrite(&count, sizeof(count), 1, file);
+        if (count) fwrite(index.data(), sizeof(IndexEntry), index.size(), file);
+        fwrite(&indexOffset, sizeof(indexOffset), 1, file);
+        fwrite(END_MAGIC, sizeof(END_MAGIC), 1, file);
+        fclose(file);
+        file = nullptr;
+    }
+
+    uint64_t droppedFrames() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return dropped;
+    }
+
+private:
+    FILE* file = nullptr;
+    std::thread worker;
+    mutable std::mutex mutex;
+    std::condition_variable wake, freed;
+    bool running = false;
+    sim::Snapshot slots[SLOTS];
+    std::vector<int> free;
+    std::deque<int> ready;
+    uint64_t dropped = 0;
+
+    // writer thread only
+    double step[CHANNELS] = {};
+    uint64_t offset = 0;
+    std::vector<IndexEntry> index;
+    int sinceKey = 0;
+    std::vector<uint32_t> lastIds;
+    std::vector<double> lastM, lastR;
+    std::vector<int64_t> last[CHANNELS];
+    std::vector<int64_t> quantised[CHANNELS];
+    std::vector<uint8_t> buffer;
+
+    void run() {
+        for (;;) {
+            int slot;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this]() { return !ready.empty() || !running; });
+                if (ready.empty()) return;
+                slot = ready.front();
+                ready.pop_front();
+            }
+            write(slots[slot]);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                free.push_back(slot);
+            }
+            freed.notify_one();
+        }
+    }
+
+    template <class T>
+    void append(const T* p, size_t n) {
+        const uint8_t* b = reinterpret_cast<const uint8_t*>(p);
+        buffer.insert(buffer.end(), b, b + n * sizeof(T));
+    }
+
+    void write(const sim::Snapshot& s) {
+        const size_t n = s.id.size();
+        const std::vector<double>* channel[CHANNELS] = { &s.x, &s.y, &s.z, &s.vx, &s.vy, &s.vz };
+        for (int c = 0; c < CHANNELS; ++c) {
+            quantised[c].resize(n);
+            const double inv = 1.0 / step[c];
+            for (size_t i = 0; i < n; ++i) quantised[c][i] = int64_t(std::llround((*channel[c])[i] * inv));
+        }
+        const bool key = sinceKey >= KEY_INTERVAL || s.id != lastIds || s.m != lastM || s.r != lastR;
+
+        buffer.clear();
+        const uint32_t size = 0;    // patched below
+        const uint8_t head[4] = { uint8_t(key ? KEY : DELTA), 0, 0, 0 };
+        const uint32_t count = uint32_t(n);
+        append(&size, 1);
+        append(head, 4);
+        append(&s.tick, 1);
+        append(&s.time, 1);
+        append(&count, 1);
+        if (key) {
+            append(s.id.data(), n);
+            append(s.m.data(), n);
+            append(s.r.data(), n);
+            for (int c = 0; c < CHANNELS; ++c)
+                for (size_t i = 0; i < n; ++i) putVarint(buffer, quantised[c][i]);
+            index.push_back(IndexEntry{ s.tick, s.time, offset });
+            sinceKey = 0;
+            lastIds = s.id;
+            lastM = s.m;
+            lastR = s.r;
+        } else {
+            for (int c = 0; c < CHANNELS; ++c)
+                for (size_t i = 0; i < n; ++i) putVarint(buffer, quantised[c][i] - last[c][i]);
+        }
+        sinceKey++;
+        for (int c = 0; c < CHANNELS; ++c) last[c].swap(quantised[c]);
+
+        const uint32_t rest = uint32_t(buffer.size() - sizeof(uint32_t));
+        memcpy(buffer.data(), &rest, sizeof(rest));
+        fwrite(buffer.data(), 1, buffer.size(), file);
+        offset += buffer.size();
+        if (frameEvent >= 0)
+            telemetry::log(uint16_t(frameEvent), double(buffer.size()), key ? 1.0 : 0.0);
+    }
+};
+
+// Decodes a recording into sim::Snapshots. The file is memory-mapped.
+class Reader {
+public:
+    bool open(const char* path, std::string& error) {
+        if (!file.open(path)) {
+            error = std::string("cannot map ") + path;
+            return false;
+        }
+        if (file.size() < sizeof(Header) || memcmp(header().magic, MAGIC, sizeof(MAGIC)) != 0) {
+            error = std::string(path) + " is not a recording";
+            file.close();
+            return false;
+        }
+        if (header().version != VERSION) {
+            error = std::string(path) + ": unsupported recording version " + std::to_string(header().version);
+            file.close();
+            return false;
+        }
+        const Header& h = header();
+        step[0] = step[1] = step[2] = h.positionStep;
+        step[3] = step[4] = step[5] = h.velocityStep;
+        if (!readIndex()) scanIndex();
+        if (index.empty()) {
+            error = std::string(path) + ": no frames";
+            file.close();
+            return false;
+        }
+        // walk the record headers after the last keyframe for the final tick
+        last = index.back().tick;
+        for (uint64_t at = index.back().offset; recordsEnd - at >= 4 + 4 + 8;) {
+            uint32_t rest;
+            memcpy(&rest, bytes() + at, 4);
+            if (recordsEnd - at - 4 < rest) break;
+            memcpy(&last, bytes() + at + 8, 8);
+            at += 4 + rest;
+        }
+        seek(index.front().tick);
+        return true;
+    }
+
+    const Header& header() const { return *reinterpret_cast<const Header*>(file.data()); }
+    const std::vector<IndexEntry>& keyframes() const { return index; }
+    uint64_t firstTick() const { return index.front().tick; }
+    uint64_t lastTick() const { return last; }
+
+    // Decode the next frame into out; false at the end of the recording
+    bool next(sim::Snapshot& out) {
+        const uint8_t* p = bytes() + cursor;
+        const uint8_t* end = bytes() + recordsEnd;
+        if (end - p < 4) return false;
+        uint32_t rest;
+        memcpy(&rest, p, 4);
+        if (uint64_t(end - p - 4) < rest) return false;
+        const uint8_t* record = p + 4;
+        const uint8_t* recordEnd = record + rest;
+        if (!decode(record, recordEnd, out)) return false;
+        cursor += 4 + rest;
+        return true;
+    }
+
+    // The frame at or before tick. Decodes forward from the last frame, or
+    // from the nearest keyframe when that is closer or tick is behind us.
+    bool frameAt(uint64_t tick, sim::Snapshot& out) {
+        if (!haveFrame || tick < frame.tick || keyBefore(tick) > cursor) seek(tick);
+        uint64_t nextTick;
+        while (peekTick(nextTick) && nextTick <= tick) {
+            if (!next(frame)) break;
+            haveFrame = true;
+        }
+        if (!haveFrame) return false;
+        out = frame;
+        return true;
+    }
+
+private:
+    scene::MappedFile file;
+    double step[CHANNELS] = {};
+    std::vector<IndexEntry> index;
+    uint64_t recordsEnd = 0;
+    uint64_t last = 0;
+    uint64_t cursor = 0;
+    // decoder state: the last decoded frame's ids, masses, radii and quantised channels
+    std::vector<uint32_t> ids;
+    std::vector<double> mass, radius;
+    std::vector<int64_t> q[CHANNELS];
+    bool haveFrame = false;
+    sim::Snapshot frame;
+
+    const uint8_t* bytes() const { return reinterpret_cast<const uint8_t*>(file.data()); }
+
+    bool readIndex() {
+        const size_t size = file.size();
+        if (size < sizeof(Header) + 16 + 16) return false;
+        if (memcmp(bytes() + size - 8, END_MAGIC, 8) != 0) return false;
+        uint64_t at, count;
+        memcpy(&at, bytes() + size - 16, 8);
+        if (at < sizeof(Header) || at + 16 > size - 16 || memcmp(bytes() + at, INDEX_MAGIC, 8) != 0) return false;
+        memcpy(&count, bytes() + at + 8, 8);
+        if (count > (size - 16 - at - 16) / sizeof(IndexEntry)) return false;
+        index.resize(size_t(count));
+        if (count) memcpy(index.data(), bytes() + at + 16, size_t(count) * sizeof(IndexEntry));
+        recordsEnd = at;
+        return true;
+    }
+    void scanIndex() {
+        index.clear();
+        uint64_t at = sizeof(Header);
+        const uint64_t size = file.size();
+        while (size - at >= 4 + 4 + 8 + 8 + 4) {
+            uint32_t rest;
+            memcpy(&rest, bytes() + at, 4);
+            if (rest < 24 || size - at - 4 < rest) break;
+            if (bytes()[at + 4] == KEY) {
+                IndexEntry e;
+                e.offset = at;
+                memcpy(&e.tick, bytes() + at + 8, 8);
+                memcpy(&e.time, bytes() + at + 16, 8);
+                index.push_back(e);
+            }
+            at += 4 + rest;
+        }
+        recordsEnd = at;
+    }
+
+    uint64_t keyBefore(uint64_t tick) const {
+        size_t k = 0;
+        for (size_t lo = 0, hi = index.size(); lo < hi;) {
+            size_t mid = (lo + hi) / 2;
+            if (index[mid].tick <= tick) { k = mid; lo = mid + 1; }
+            else hi = mid;
+        }
+        return index[k].offset;
+    }
+    void seek(uint64_t tick) {
+        cursor = keyBefore(tick);
+        haveFrame = false;
+    }
+    bool peekTick(uint64_t& tick) const {
+        if (recordsEnd - cursor < 4 + 4 + 8) return false;
+        memcpy(&tick, bytes() + cursor + 8, 8);
+        return true;
+    }
+    bool decode(const uint8_t* p, const uint8_t* end, sim::Snapshot& out) {
+        if (end - p < 24) return false;
+        const uint8_t kind = p[0];
+        uint32_t n;
+        memcpy(&out.tick, p + 4, 8);
+        memcpy(&out.time, p + 12, 8);
+        memcpy(&n, p + 20, 4);
+        p += 24;
+        if (kind == KEY) {
+            if (uint64_t(end - p) < uint64_t(n) * 20) return false;
+            ids.resize(n);
+            mass.resize(n);
+            radius.resize(n);
+            if (n) {
+                memcpy(ids.data(), p, n * 4);
+                memcpy(mass.data(), p + n * 4, n * 8);
+                memcpy(radius.data(), p + n * 12, n * 8);
+            }
+            p += size_t(n) * 20;
+        } else if (kind != DELTA || n != ids.size()) {
+            return false;       // a delta needs the frame before it
+        }
+        for (int c = 0; c < CHANNELS; ++c) {
+            q[c].resize(n);
+            for (uint32_t i = 0; i < n; ++i) {
+                int64_t v;
+                if (!getVarint(p, end, v)) return false;
+                q[c][i] = kind == KEY ? v : q[c][i] + v;
+            }
+        }
+        out.id = ids;
+        out.m = mass;
+        out.r = radius;
+        std::vector<double>* channel[CHANNELS] = { &out.x, &out.y, &out.z, &out.vx, &out.vy, &out.vz };
+        for (int c = 0; c < CHANNELS; ++c) {
+            channel[c]->resize(n);
+            for (uint32_t i = 0; i < n; ++i) (*channel[c])[i] = double(q[c][i]) * step[c];
+        }
+        out.commands = UINT64_MAX;      // nothing is pending in a replay
+        out.energyDrift = 0.0;
+        return true;
+    }
+};
+
+} // namespace recording
@@ -0,0 +1,231 @@
+// recording_check.cpp - round-trip checks for recording.h
+//
+// Writes a synthetic run (bodies drifting, one removed, a mass changing, a
+// body added, and some ticks skipped) and reads it back:
+//
+//   roundtrip   every frame decodes in order, ids/masses/radii exactly and
+//               positions/velocities within half a quantisation step
+//   seek        frameAt() at ticks in any order gives the frame at or before
+//               the tick, identical to decoding sequentially
+//   truncated   the file with its index cut off, and cut mid-record, still
+//               opens and gives the same frames up to the cut
+//
+//   ./recording_check [roundtrip|seek|truncated]    all three by default
+//
+// Exits non-zero on the first failure. Scratch files go in the current
+// directory, named after the check so ctest can run them in parallel, and
+// are removed afterwards.
+#include "recording.h"
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+static std::string path, cutPath;     // scratch files
+static const double POSITION_STEP = 10.0, VELOCITY_STEP = 1e-3;
+
+static int failures = 0;
+
+static void fail(const char* check, const std::string& what) {
+    fprintf(stderr, "%s: %s\n", check, what.c_str());
+    failures++;
+}
+
+// The frames pushed to the writer, as the physics thread would publish them
+static std::vector<sim::Snapshot> makeRun() {
+    std::mt19937_64 rng(7);
+    std::normal_distribution<double> N(0.0, 1.0);
+    sim::Snapshot s;
+    for (uint32_t i = 0; i < 400; ++i) {
+        s.id.push_back(i);
+        s.x.push_back(1e9 * N(rng));  s.y.push_back(1e9 * N(rng));  s.z.push_back(1e7 * N(rng));
+        s.vx.push_back(3e4 * N(rng));  s.vy.push_back(3e4 * N(rng));  s.vz.push_back(10.0 * N(rng));
+        s.m.push_back(1e24 * (1.0 + i));
+        s.r.push_back(1e6);
+    }
+    std::vector<sim::Snapshot> run;
+    const double dt = 60.0;
+    for (uint64_t tick = 0; tick < 300; ++tick) {
+        for (size_t i = 0; i < s.id.size(); ++i) {
+            s.vx[i] += 0.1 * N(rng);
+            s.vy[i] += 0.1 * N(rng);
+            s.x[i] += s.vx[i] * dt;
+            s.y[i] += s.vy[i] * dt;
+            s.z[i] += s.vz[i] * dt;
+        }
+        if (tick == 100) {      // body 17 absorbed
+            std::vector<double>* columns[8] = { &s.x, &s.y, &s.z, &s.vx, &s.vy, &s.vz, &s.m, &s.r };
+            for (auto* c : columns) c->erase(c->begin() + 17);
+            s.id.erase(s.id.begin() + 17);
+        }
+        if (tick == 170) s.m[3] *= 2.0;
+        if (tick == 230) {
+            s.id.push_back(1000);
+            s.x.push_back(-5e8);  s.y.push_back(2e8);  s.z.push_back(0.0);
+            s.vx.push_back(0.0);  s.vy.push_back(-1e4);  s.vz.push_back(0.0);
+            s.m.push_back(5e23);
+            s.r.push_back(2e5);
+        }
+        if (tick >= 120 && tick < 160 && tick % 3 != 0) continue;   // gaps, as with --dump-every
+        s.tick = tick;
+        s.time = double(tick) * dt;
+        run.push_back(s);
+    }
+    return run;
+}
+
+static bool writeRun(const std::vector<sim::Snapshot>& run) {
+    recording::Writer writer;
+    writer.lossless = true;
+    if (!writer.open(path.c_str(), 1.0, POSITION_STEP, VELOCITY_STEP)) {
+        fail("write", "cannot create " + path);
+        return false;
+    }
+    for (const sim::Snapshot& s : run) writer.push(s);
+    writer.close();
+    return true;
+}
+
+static std::vector<sim::Snapshot> readAll(recording::Reader& reader) {
+    std::vector<sim::Snapshot> frames;
+    sim::Snapshot s;
+    while (reader.next(s)) frames.push_back(s);
+    return frames;
+}
+
+static bool sameFrame(const sim::Snapshot& a, const sim::Snapshot& b) {
+    return a.tick == b.tick && a.time == b.time && a.id == b.id && a.m == b.m && a.r == b.r &&
+           a.x == b.x && a.y == b.y && a.z == b.z && a.vx == b.vx && a.vy == b.vy && a.vz == b.vz;
+}
+
+static void checkRoundTrip(const std::vector<sim::Snapshot>& run) {
+    const char* check = "roundtrip";
+    recording::Reader reader;
+    std::string error;
+    if (!reader.open(path.c_str(), error)) return fail(check, error);
+    const std::vector<sim::Snapshot> frames = readAll(reader);
+    if (frames.size() != run.size())
+        return fail(check, std::to_string(frames.size()) + " frames read, " + std::to_string(run.size()) + " written");
+    double worst[2] = { 0.0, 0.0 };    // error in steps: position, velocity
+    for (size_t f = 0; f < run.size(); ++f) {
+        const sim::Snapshot& in = run[f];
+        const sim::Snapshot& out = frames[f];
+        if (out.tick != in.tick || out.time != in.time || out.id != in.id || out.m != in.m || out.r != in.r)
+            return fail(check, "tick " + std::to_string(in.tick) + ": header, ids, masses or radii differ");
+        const std::vector<double>* a[6] = { &in.x, &in.y, &in.z, &in.vx, &in.vy, &in.vz };
+        const std::vector<double>* b[6] = { &out.x, &out.y, &out.z, &out.vx, &out.vy, &out.vz };
+        for (int c = 0; c < 6; ++c) {
+            const double step = c < 3 ? POSITION_STEP : VELOCITY_STEP;
+            for (size_t i = 0; i < in.id.size(); ++i) {
+                // the last few bits of a large coordinate are lost in x / step itself
+                const double slack = 4e-16 * std::fabs((*a[c])[i]);
+                const double e = std::fabs((*b[c])[i] - (*a[c])[i]);
+                if (e > 0.5 * step + slack)
+                    return fail(check, "tick " + std::to_string(in.tick) + ": error of " + std::to_string(e / step) +
+                                           " steps");
+                worst[c / 3] = std::max(worst[c / 3], e / step);
+            }
+        }
+    }
+    printf("%-10s %zu frames, %zu keyframes, worst error %.3f (position) %.3f (velocity) steps\n", check,
+           frames.size(), reader.keyframes().size(), worst[0], worst[1]);
+}
+
+static void checkSeek() {
+    const char* check = "seek";
+    recording::Reader sequential, seeking;
+    std::string error;
+    if (!sequential.open(path.c_str(), error) || !seeking.open(path.c_str(), error)) return fail(check, error);
+    const std::vector<sim::Snapshot> frames = readAll(sequential);
+    if (frames.empty()) return fail(check, "no frames");
+
+    // forwards, backwards, into the gaps, and past both ends
+    std::vector<uint64_t> ticks;
+    for (uint64_t t = 0; t < 300; t += 7) ticks.push_back(t);
+    for (uint64_t t = 299; t > 0; t -= 13) ticks.push_back(t);
+    const uint64_t jumps[] = { 250, 5, 131, 130, 129, 64, 63, 65, 299, 1000, 0, 101, 100, 171, 230 };
+    ticks.insert(ticks.end(), jumps, jumps + sizeof(jumps) / sizeof(jumps[0]));
+    std::mt19937_64 rng(11);
+    for (int k = 0; k < 200; ++k) ticks.push_back(rng() % 320);
+
+    sim::Snapshot s;
+    for (uint64_t t : ticks) {
+        size_t f = 0;
+        while (f + 1 < frames.size() && frames[f + 1].tick <= t) ++f;
+        if (!seeking.frameAt(t, s)) return fail(check, "frameAt(" + std::to_string(t) + ") failed");
+        if (!sameFrame(s, frames[f]))
+            return fail(check, "frameAt(" + std::to_string(t) + ") differs from tick " +
+                                   std::to_string(frames[f].tick) + " decoded in order");
+    }
+    printf("%-10s %zu seeks match sequential decoding\n", check, ticks.size());
+}
+
+static bool copyPrefix(const std::vector<char>& bytes, size_t n) {
+    FILE* f = fopen(cutPath.c_str(), "wb");
+    if (!f) return false;
+    const bool ok = fwrite(bytes.data(), 1, n, f) == n;
+    return (fclose(f) == 0) && ok;
+}
+
+static void checkTruncated() {
+    const char* check = "truncated";
+    std::vector<char> bytes;
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) return fail(check, "cannot open " + path);
+    char buffer[65536];
+    for (size_t n; (n = fread(buffer, 1, sizeof(buffer), f)) > 0;) bytes.insert(bytes.end(), buffer, buffer + n);
+    fclose(f);
+    uint64_t indexOffset = 0;
+    if (bytes.size() < 16 || memcmp(bytes.data() + bytes.size() - 8, recording::END_MAGIC, 8) != 0)
+        return fail(check, "no index trailer");
+    memcpy(&indexOffset, bytes.data() + bytes.size() - 16, 8);
+
+    recording::Reader full;
+    std::string error;
+    if (!full.open(path.c_str(), error)) return fail(check, error);
+    const std::vector<sim::Snapshot> frames = readAll(full);
+
+    // cut where the index starts, as if the program died before close(),
+    // then part-way through the last record
+    const size_t cuts[2] = { size_t(indexOffset), size_t(indexOffset) - 5 };
+    const size_t expect[2] = { frames.size(), frames.size() - 1 };
+    for (int k = 0; k < 2; ++k) {
+        if (!copyPrefix(bytes, cuts[k])) return fail(check, "cannot create " + cutPath);
+        recording::Reader cut;
+        if (!cut.open(cutPath.c_str(), error)) return fail(check, error);
+        if (k == 0 && cut.keyframes().size() != full.keyframes().size())
+            return fail(check, "rebuilt index has " + std::to_string(cut.keyframes().size()) + " keyframes, not " +
+                                   std::to_string(full.keyframes().size()));
+        const std::vector<sim::Snapshot> got = readAll(cut);
+        if (got.size() != expect[k])
+            return fail(check, std::to_string(got.size()) + " frames after the cut, expected " +
+                                   std::to_string(expect[k]));
+        for (size_t i = 0; i < got.size(); ++i)
+            if (!sameFrame(got[i], frames[i])) return fail(check, "frame " + std::to_string(i) + " differs after the cut");
+        sim::Snapshot s;
+        if (!cut.frameAt(got.back().tick, s) || !sameFrame(s, got.back()))
+            return fail(check, "frameAt() on the cut file differs");
+        if (cut.lastTick() != got.back().tick) return fail(check, "lastTick() runs past the cut");
+    }
+    printf("%-10s opens without an index and with a partial last record\n", check);
+}
+
+int main(int argc, char** argv) {
+    const std::string only = argc > 1 ? argv[1] : "";
+    if (argc > 2 || (!only.empty() && only != "roundtrip" && only != "seek" && only != "truncated")) {
+        fprintf(stderr, "usage: %s [roundtrip|seek|truncated]\n", argv[0]);
+        return 2;
+    }
+    path = "recording_check_" + (only.empty() ? std::string("all") : only) + ".bhrec";
+    cutPath = "recording_check_" + (only.empty() ? std::string("all") : only) + "_cut.bhrec";
+    const std::vector<sim::Snapshot> run = makeRun();
+    if (!writeRun(run)) return 1;
+    if (only.empty() || only == "roundtrip") checkRoundTrip(run);
+    if (only.empty() || only == "seek") checkSeek();
+    if (only.empty() || only == "truncated") checkTruncated();
+    remove(path.c_str());
+    remove(cutPath.c_str());
+    return failures == 0 ? 0 : 1;
+}
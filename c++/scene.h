@@ -0,0 +1,278 @@
+// scene.h - binary scene / initial-conditions files
+//
+// A scene file is a fixed 256-byte header followed by one column per body
+// attribute, so a loader maps the file and points straight at the arrays;
+// nothing is parsed and the cost of opening a multi-million-body scene is
+// the page faults of the columns actually read. scene_convert.cpp writes
+// these files from a line-based text format.
+//
+// Layout, version 1 (all values little-endian, units SI):
+//
+//   offset  type        field
+//   0       char[8]     magic "BHSCENE" + NUL
+//   8       u32         version (1)
+//   12      u32         flags (HAS_BLACK_HOLE, HAS_CAMERA)
+//   16      u64         body count N
+//   24      u64[10]     byte offset of each column from the start of the file,
+//                       in Column order, each a multiple of 64
+//   104     f64         black hole mass (kg)
+//   112     f64[3]      black hole position (m)
+//   136     f64[3]      camera position (m)
+//   160     f64[3]      camera target (m)
+//   184     f64         camera vertical field of view (degrees)
+//   192     -           reserved, zero
+//
+//   columns: X, Y, Z (m), VX, VY, VZ (m/s), MASS (kg), RADIUS (m),
+//            DENSITY (kg/m^3) as N f64 each; COLOR as N x 4 f32 (RGBA)
+//
+// Readers reject other magics and versions, and files whose columns run past
+// the end. New fields go into the reserved bytes or new columns with a
+// version bump.
+#pragma once
+
+#include "nbody.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+namespace scene {
+
+static const uint32_t VERSION = 1;
+static const char MAGIC[8] = { 'B', 'H', 'S', 'C', 'E', 'N', 'E', 0 };
+
+enum Flags : uint32_t { HAS_BLACK_HOLE = 1, HAS_CAMERA = 2 };
+enum Column { X, Y, Z, VX, VY, VZ, MASS, RADIUS, DENSITY, COLOR, COLUMN_COUNT };
+
+struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint64_t count;
+    uint64_t offset[COLUMN_COUNT];
+    double blackHoleMass;
+    double blackHolePosition[3];
+    double cameraPosition[3];
+    double cameraTarget[3];
+    double cameraFov;
+    unsigned char reserved[64];
+};
+static_assert(sizeof(Header) == 256, "scene header layout changed");
+
+inline size_t elementBytes(Column c) {
+    return c == COLOR ? 4 * sizeof(float) : sizeof(double);
+}
+inline size_t columnBytes(Column c, uint64_t count) {
+    return size_t(count) * elementBytes(c);
+}
+
+// In-memory scene, used to write files
+struct Data {
+    uint32_t flags = 0;
+    double blackHoleMass = 0.0;
+    double blackHolePosition[3] = { 0.0, 0.0, 0.0 };
+    double cameraPosition[3] = { 0.0, 0.0, 0.0 };
+    double cameraTarget[3] = { 0.0, 0.0, 0.0 };
+    double cameraFov = 0.0;
+    std::vector<double> x, y, z, vx, vy, vz, mass, radius, density;
+    std::vector<float> color;   // RGBA per body
+
+    size_t size() const { return mass.size(); }
+};
+
+// Writes d to path; returns false and sets error on failure
+inline bool write(const char* path, const Data& d, std::string& error) {
+    const uint64_t n = d.size();
+    Header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, MAGIC, sizeof(MAGIC));
+    h.version = VERSION;
+    h.flags = d.flags;
+    h.count = n;
+    h.blackHoleMass = d.blackHoleMass;
+    h.cameraFov = d.cameraFov;
+    for (int k = 0; k < 3; ++k) {
+        h.blackHolePosition[k] = d.blackHolePosition[k];
+        h.cameraPosition[k] = d.cameraPosition[k];
+        h.cameraTarget[k] = d.cameraTarget[k];
+    }
+    const void* data[COLUMN_COUNT] = { d.x.data(), d.y.data(), d.z.data(), d.vx.data(), d.vy.data(),
+                                       d.vz.data(), d.mass.data(), d.radius.data(), d.density.data(),
+                                       d.color.data() };
+    uint64_t at = sizeof(Header);
+    for (int c = 0; c < COLUMN_COUNT; ++c) {
+        at = (at + 63) / 64 * 64;
+        h.offset[c] = at;
+        at += columnBytes(Column(c), n);
+    }
+
+    FILE* f = fopen(path, "wb");
+    if (!f) {
+        error = std::string("cannot create ") + path;
+        return false;
+    }
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+    uint64_t pos = sizeof(Header);
+    static const char zeros[64] = {};
+    for (int c = 0; c < COLUMN_COUNT && ok; ++c) {
+        ok = fwrite(zeros, 1, size_t(h.offset[c] - pos), f) == size_t(h.offset[c] - pos);
+        size_t bytes = columnBytes(Column(c), n);
+        if (ok && bytes) ok = fwrite(data[c], 1, bytes, f) == bytes;
+        pos = h.offset[c] + bytes;
+    }
+    ok = (fclose(f) == 0) && ok;
+    if (!ok) error = std::string("write failed: ") + path;
+    return ok;
+}
+
+// Read-only memory mapping of a whole file
+class MappedFile {
+public:
+    MappedFile() {}
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { close(); }
+
+    bool open(const char* path) {
+        close();
+        return map(path);
+    }
+    void close() {
+        if (base) unmap();
+        base = nullptr;
+        bytes = 0;
+    }
+    const char* data() const { return static_cast<const char*>(base); }
+    size_t size() const { return bytes; }
+
+private:
+    const void* base = nullptr;
+    size_t bytes = 0;
+#ifdef _WIN32
+    HANDLE fileHandle = INVALID_HANDLE_VALUE, mapping = nullptr;
+
+    bool map(const char* path) {
+        fileHandle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                                 FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (fileHandle == INVALID_HANDLE_VALUE) return false;
+        LARGE_INTEGER size;
+        if (GetFileSizeEx(fileHandle, &size) && size.QuadPart > 0) {
+            mapping = CreateFileMappingA(fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (mapping) base = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            bytes = size_t(size.QuadPart);
+        }
+        if (!base) unmap();
+        return base != nullptr;
+    }
+    void unmap() {
+        if (base) UnmapViewOfFile(base);
+        if (mapping) CloseHandle(mapping);
+        if (fileHandle != INVALID_HANDLE_VALUE) CloseHandle(fileHandle);
+        mapping = nullptr;
+        fileHandle = INVALID_HANDLE_VALUE;
+    }
+#else
+    bool map(const char* path) {
+        // stdio rather than open()/close(): <unistd.h> would drag names like
+        // pause() into programs that include this header
+        FILE* f = fopen(path, "rb");
+        if (!f) return false;
+        struct stat st;
+        if (fstat(fileno(f), &st) == 0 && st.st_size > 0) {
+            void* p = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fileno(f), 0);
+            if (p != MAP_FAILED) {
+                base = p;
+                bytes = size_t(st.st_size);
+            }
+        }
+        fclose(f);   // the mapping keeps the file alive
+        return base != nullptr;
+    }
+    void unmap() { munmap(const_cast<void*>(base), bytes); }
+#endif
+};
+
+// Read-only memory mapping of a scene file. Columns point into the mapping
+// and stay valid until the File is closed or destroyed.
+class File {
+public:
+    File() {}
+    File(const File&) = delete;
+    File& operator=(const File&) = delete;
+    ~File() { close(); }
+
+    bool open(const char* path, std::string& error) {
+        close();
+        if (!file.open(path)) {
+            error = std::string("cannot map ") + path;
+            return false;
+        }
+        base = file.data();
+        bytes = file.size();
+        if (bytes < sizeof(Header) || memcmp(header().magic, MAGIC, sizeof(MAGIC)) != 0) {
+            error = std::string(path) + " is not a scene file";
+            close();
+            return false;
+        }
+        if (header().version != VERSION) {
+            error = std::string(path) + ": unsupported scene version " + std::to_string(header().version);
+            close();
+            return false;
+        }
+        for (int c = 0; c < COLUMN_COUNT; ++c) {
+            // divide rather than multiply: a corrupt count must not wrap around
+            uint64_t off = header().offset[c];
+            if (off % 64 != 0 || off > bytes || header().count > (bytes - off) / elementBytes(Column(c))) {
+                error = std::string(path) + ": truncated or corrupt column table";
+                close();
+                return false;
+            }
+        }
+        return true;
+    }
+    void close() {
+        file.close();
+        base = nullptr;
+        bytes = 0;
+    }
+
+    const Header& header() const { return *reinterpret_cast<const Header*>(base); }
+    size_t size() const { return size_t(header().count); }
+    const double* column(Column c) const {
+        return reinterpret_cast<const double*>(static_cast<const char*>(base) + header().offset[c]);
+    }
+    const float* color() const {
+        return reinterpret_cast<const float*>(static_cast<const char*>(base) + header().offset[COLOR]);
+    }
+
+    // Bulk copy of the dynamic state into solver arrays
+    void copyTo(nbody::Bodies& b) const {
+        const size_t n = size();
+        b.resize(n);
+        std::vector<double>* dst[7] = { &b.x, &b.y, &b.z, &b.vx, &b.vy, &b.vz, &b.m };
+        const Column src[7] = { X, Y, Z, VX, VY, VZ, MASS };
+        for (int k = 0; k < 7; ++k) {
+            if (n) memcpy(dst[k]->data(), column(src[k]), n * sizeof(double));
+        }
+        std::fill(b.ax.begin(), b.ax.end(), 0.0);
+        std::fill(b.ay.begin(), b.ay.end(), 0.0);
+        std::fill(b.az.begin(), b.az.end(), 0.0);
+    }
+
+private:
+    MappedFile file;
+    const void* base = nullptr;
+    size_t bytes = 0;
+};
+
+} // namespace scene
@@ -0,0 +1,156 @@
+// scene_convert.cpp - text <-> binary scene files (see scene.h)
+//
+// Text format, one record per line, SI units, '#' starts a comment:
+//
+//   blackhole <mass> <x> <y> <z>
+//   camera    <x> <y> <z> <target x> <target y> <target z> <fov degrees>
+//   body      <x> <y> <z> <vx> <vy> <vz> <mass> <radius> <density> <r> <g> <b> <a>
+//
+//   ./scene_convert scene.txt scene.bhs      text -> binary
+//   ./scene_convert --dump scene.bhs         binary -> text on stdout
+//   ./scene_convert --disc N scene.bhs       N bodies orbiting a star, for benchmarks
+#include "scene.h"
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+static bool parseText(const char* path, scene::Data& d) {
+    std::ifstream in(path);
+    if (!in) {
+        std::cerr << "cannot open " << path << std::endl;
+        return false;
+    }
+    std::string line;
+    for (int lineNo = 1; std::getline(in, line); ++lineNo) {
+        size_t hash = line.find('#');
+        if (hash != std::string::npos) line.erase(hash);
+        std::istringstream ss(line);
+        std::string kind;
+        if (!(ss >> kind)) continue;
+        bool ok;
+        if (kind == "body") {
+            double v[9];
+            float col[4];
+            ok = bool(ss >> v[0] >> v[1] >> v[2] >> v[3] >> v[4] >> v[5] >> v[6] >> v[7] >> v[8]
+                         >> col[0] >> col[1] >> col[2] >> col[3]);
+            if (ok) {
+                d.x.push_back(v[0]);  d.y.push_back(v[1]);  d.z.push_back(v[2]);
+                d.vx.push_back(v[3]); d.vy.push_back(v[4]); d.vz.push_back(v[5]);
+                d.mass.push_back(v[6]); d.radius.push_back(v[7]); d.density.push_back(v[8]);
+                d.color.insert(d.color.end(), col, col + 4);
+            }
+        } else if (kind == "blackhole") {
+            ok = bool(ss >> d.blackHoleMass >> d.blackHolePosition[0] >> d.blackHolePosition[1] >> d.blackHolePosition[2]);
+            d.flags |= scene::HAS_BLACK_HOLE;
+        } else if (kind == "camera") {
+            ok = bool(ss >> d.cameraPosition[0] >> d.cameraPosition[1] >> d.cameraPosition[2]
+                         >> d.cameraTarget[0] >> d.cameraTarget[1] >> d.cameraTarget[2] >> d.cameraFov);
+            d.flags |= scene::HAS_CAMERA;
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            std::cerr << path << ":" << lineNo << ": cannot parse '" << line << "'" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+static void dump(const scene::File& f) {
+    const scene::Header& h = f.header();
+    printf("# scene version %u, %llu bodies\n", h.version, (unsigned long long)h.count);
+    if (h.flags & scene::HAS_BLACK_HOLE)
+        printf("blackhole %.17g %.17g %.17g %.17g\n", h.blackHoleMass,
+               h.blackHolePosition[0], h.blackHolePosition[1], h.blackHolePosition[2]);
+    if (h.flags & scene::HAS_CAMERA)
+        printf("camera %.17g %.17g %.17g %.17g %.17g %.17g %.17g\n",
+               h.cameraPosition[0], h.cameraPosition[1], h.cameraPosition[2],
+               h.cameraTarget[0], h.cameraTarget[1], h.cameraTarget[2], h.cameraFov);
+    const double* col[9];
+    for (int c = 0; c < 9; ++c) col[c] = f.column(scene::Column(c));
+    const float* rgba = f.color();
+    for (size_t i = 0; i < f.size(); ++i) {
+        printf("body");
+        for (int c = 0; c < 9; ++c) printf(" %.17g", col[c][i]);
+        printf(" %.9g %.9g %.9g %.9g\n", rgba[4 * i], rgba[4 * i + 1], rgba[4 * i + 2], rgba[4 * i + 3]);
+    }
+}
+
+// A star of gravity_sim's default mass and density with n light bodies on
+// circular orbits 10,000 to 50,000 km out, in a disc about 1% as thick as it
+// is wide. The bodies barely pull on each other, so the orbits hold and a
+// headless run's energy drift shows the solver and integrator error.
+static void makeDisc(size_t n, scene::Data& d) {
+    const double G = 6.6743e-11, PI = 3.14159265358979323846;
+    const double starMass = 1.91e29, starDensity = 2.08e11;
+    const double bodyMass = 1e20, bodyDensity = 5500.0;
+    const double rMin = 1e7, rMax = 5e7;
+    auto add = [&](double x, double y, double z, double vx, double vy, double vz, double m, double rho,
+                   float r, float g, float b) {
+        d.x.push_back(x);  d.y.push_back(y);  d.z.push_back(z);
+        d.vx.push_back(vx);  d.vy.push_back(vy);  d.vz.push_back(vz);
+        d.mass.push_back(m);
+        d.radius.push_back(std::cbrt(3.0 * m / (4.0 * PI * rho)));
+        d.density.push_back(rho);
+        const float rgba[4] = { r, g, b, 1.0f };
+        d.color.insert(d.color.end(), rgba, rgba + 4);
+    };
+    add(0, 0, 0, 0, 0, 0, starMass, starDensity, 1.0f, 0.929f, 0.176f);
+    uint64_t state = 0x9E3779B97F4A7C15ull;   // fixed seed: the same N gives the same scene
+    auto uniform = [&state]() {
+        state = state * 6364136223846793005ull + 1442695040888963407ull;
+        return double(state >> 11) * (1.0 / 9007199254740992.0);
+    };
+    for (size_t i = 0; i < n; ++i) {
+        const double r = rMin + (rMax - rMin) * uniform();
+        const double phi = 2.0 * PI * uniform();
+        const double y = 0.01 * r * (uniform() - 0.5);
+        const double v = std::sqrt(G * starMass / r);
+        add(r * std::cos(phi), y, r * std::sin(phi), -v * std::sin(phi), 0.0, v * std::cos(phi),
+            bodyMass, bodyDensity, 0.6f, 0.8f, 1.0f);
+    }
+    d.flags |= scene::HAS_CAMERA;
+    d.cameraPosition[1] = 0.5 * rMax;
+    d.cameraPosition[2] = 1.5 * rMax;
+    d.cameraFov = 45.0;
+}
+
+int main(int argc, char** argv) {
+    std::string error;
+    if (argc == 4 && strcmp(argv[1], "--disc") == 0) {
+        scene::Data d;
+        makeDisc(size_t(strtoull(argv[2], nullptr, 10)), d);
+        if (!scene::write(argv[3], d, error)) {
+            std::cerr << error << std::endl;
+            return 1;
+        }
+        std::cout << "wrote " << d.size() << " bodies to " << argv[3] << std::endl;
+        return 0;
+    }
+    if (argc == 3 && strcmp(argv[1], "--dump") == 0) {
+        scene::File f;
+        if (!f.open(argv[2], error)) {
+            std::cerr << error << std::endl;
+            return 1;
+        }
+        dump(f);
+        return 0;
+    }
+    if (argc != 3) {
+        std::cerr << "usage: " << argv[0] << " <scene.txt> <scene.bhs>\n"
+                  << "       " << argv[0] << " --dump <scene.bhs>\n"
+                  << "       " << argv[0] << " --disc <bodies> <scene.bhs>" << std::endl;
+        return 1;
+    }
+    scene::Data d;
+    if (!parseText(argv[1], d)) return 1;
+    if (!scene::write(argv[2], d, error)) {
+        std::cerr << error << std::endl;
+        return 1;
+    }
+    std::cout << "wrote " << d.size() << " bodies to " << argv[2] << std::endl;
+    return 0;
+}
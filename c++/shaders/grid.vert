@@ -1,14 +1,46 @@
 #version 330 core
 
-layout(location = 0) in vec3 aPos;      // Vertex position
-layout(location = 1) in vec3 aColor;    // Vertex color
+layout(location = 0) in vec3 aPos;      // Flat grid position (y = 0)
 
 out vec3 vColor;
 
 uniform mat4 uViewProj; // Combined view-projection matrix
+uniform samplerBuffer uWells;    // Per object: xyz = position, w = Schwarzschild radius, in tree order
+uniform samplerBuffer uWellTree; // wells::Tree nodes (well_tree.h): centroid xz, weight, extent; skip, first, count, shift
+uniform int uNumNodes;
+uniform float uTheta;           // opening angle for the tree's tolerance
+uniform vec2 uHeightRange;    // Deepest and highest grid height, for colouring
 
 void main()
 {
-    gl_Position = uViewProj * vec4(aPos, 1.0);
-    vColor = aColor;
+    // Sum every object's well: y = -2 sqrt(r_s (r - r_s)) for r > r_s, else deep pit.
+    // Stackless walk of the well tree: distant nodes count as weight * sqrt(r - shift),
+    // near leaves are summed exactly.
+    float s = 0.0;
+    int i = 0;
+    while (i < uNumNodes) {
+        vec4 a = texelFetch(uWellTree, 2 * i);
+        vec4 b = texelFetch(uWellTree, 2 * i + 1);
+        float r = length(aPos.xz - a.xy);
+        if (a.w < uTheta * r) {
+            s += a.z * sqrt(r - b.w);
+            i = int(b.x);
+        } else if (b.z > 0.0) {
+            int first = int(b.y), last = int(b.y) + int(b.z);
+            for (int k = first; k < last; ++k) {
+                vec4 well = texelFetch(uWells, k);
+                float dist = length(aPos.xz - well.xz);
+                s += dist > well.w ? sqrt(well.w * (dist - well.w)) : well.w + 5e12;
+            }
+            i = int(b.x);
+        } else {
+            ++i;
+        }
+    }
+    float y = -2.0 * s;
+    gl_Position = uViewProj * vec4(aPos.x, y, aPos.z, 1.0);
+
+    // Color by height: deep = black, high = white
+    float normY = (y - uHeightRange.x) / (uHeightRange.y - uHeightRange.x + 1e-6);
+    vColor = mix(vec3(0.0), vec3(1.0), clamp(normY, 0.0, 1.0));
 }
\ No newline at end of file
@@ -0,0 +1,413 @@
+// sim_thread.h - fixed-rate physics on its own thread
+//
+// The simulation advances in fixed ticks on a worker thread and publishes
+// body state through a lock-free triple buffer, so rendering never waits on
+// physics and simulated time no longer depends on the frame rate. The
+// renderer picks up the latest complete snapshot each frame and can blend it
+// with the one before to hide the tick rate.
+//
+// Threads: one writer (the physics thread) and one reader (the render
+// thread). Edits from the render thread (adding or removing bodies) are
+// queued and applied at the start of the next tick.
+//
+// Bodies with a radius collide: after each tick, overlapping bodies merge
+// (collide.h) and the absorbed ones disappear from the snapshots.
+//
+// Energy drift is estimated on a third thread (EnergyMonitor) from copies of
+// the bodies, since the exact energy is an O(N^2) sum that would stall ticks.
+#pragma once
+
+#include "collide.h"
+#include "nbody.h"
+#include "telemetry.h"
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace sim {
+
+inline double wallSeconds() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Single-producer, single-consumer triple buffer. The writer fills back()
+// and publish()es it, the reader calls update() and reads front(). Neither
+// side blocks: the shared middle slot is swapped atomically, and a flag bit
+// on it says whether it holds data the reader has not seen yet.
+template <class T>
+class TripleBuffer {
+public:
+    T& back() { return slots[backIndex]; }
+    void publish() {
+        backIndex = middle.exchange(backIndex | FRESH, std::memory_order_acq_rel) & INDEX;
+    }
+    // True if a newer slot was swapped in
+    bool update() {
+        if (!(middle.load(std::memory_order_acquire) & FRESH)) return false;
+        frontIndex = middle.exchange(frontIndex, std::memory_order_acq_rel) & INDEX;
+        return true;
+    }
+    const T& front() const { return slots[frontIndex]; }
+
+private:
+    static const int INDEX = 3, FRESH = 4;
+    T slots[3];
+    int backIndex = 0, frontIndex = 1;
+    std::atomic<int> middle{ 2 };
+};
+
+// Calls tick() at a fixed rate on a worker thread. When ticks run late by
+// more than MAX_BEHIND periods the lost time is dropped rather than caught
+// up, so a slow solver slows the simulation instead of spiralling.
+class FixedStepLoop {
+public:
+    static const int MAX_BEHIND = 4;
+
+    ~FixedStepLoop() { stop(); }
+
+    void start(double hz, std::function<void()> tick) {
+        stop();
+        running.store(true);
+        worker = std::thread([this, hz, tick]() {
+            using Clock = std::chrono::steady_clock;
+            const Clock::duration period =
+                std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / hz));
+            Clock::time_point next = Clock::now();
+            while (running.load(std::memory_order_acquire)) {
+                tick();
+                next += period;
+                Clock::time_point now = Clock::now();
+                if (now - next > MAX_BEHIND * period) next = now;
+                std::this_thread::sleep_until(next);
+            }
+        });
+    }
+    void stop() {
+        running.store(false);
+        if (worker.joinable()) worker.join();
+    }
+
+private:
+    std::thread worker;
+    std::atomic<bool> running{ false };
+};
+
+// Relative energy drift from nbody::System::energy(), computed on its own
+// thread. The physics thread offer()s a copy of the bodies now and then;
+// offers made while an estimate is still running are refused, so a slow
+// estimate only makes the figure stale. Each body-set generation (bumped on
+// every edit or merge) takes its first estimate as the reference. Systems
+// larger than maxBodies are not estimated at all.
+class EnergyMonitor {
+public:
+    size_t maxBodies = 100000;
+
+    ~EnergyMonitor() { stop(); }
+
+    void start(const nbody::Config& config) {
+        stop();
+        system.config = config;
+        running = true;
+        busy = false;
+        resultGeneration = UINT64_MAX;
+        worker = std::thread([this]() { run(); });
+    }
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            running = false;
+        }
+        wake.notify_one();
+        if (worker.joinable()) worker.join();
+    }
+
+    // Physics thread. False if an estimate is running or b is too large.
+    bool offer(const nbody::Bodies& b, uint64_t generation) {
+        if (b.size() > maxBodies) return false;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (busy || !running) return false;
+            busy = true;
+        }
+        // the worker only touches system while busy, and busy is ours now
+        nbody::Bodies& c = system.bodies;
+        c.x = b.x; c.y = b.y; c.z = b.z;
+        c.vx = b.vx; c.vy = b.vy; c.vz = b.vz;
+        c.m = b.m;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            offeredGeneration = generation;
+            offered = true;
+        }
+        wake.notify_one();
+        return true;
+    }
+    // Drift of the latest estimate against generation's reference, 0 until both exist
+    double drift(uint64_t generation) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return resultGeneration == generation ? latestDrift : 0.0;
+    }
+
+private:
+    nbody::System system;
+    std::thread worker;
+    mutable std::mutex mutex;
+    std::condition_variable wake;
+    bool running = false, busy = false, offered = false;
+    uint64_t offeredGeneration = 0, resultGeneration = UINT64_MAX;
+    double reference = 0.0, latestDrift = 0.0;
+
+    void run() {
+        for (;;) {
+            uint64_t generation;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this]() { return offered || !running; });
+                if (!running) return;
+                offered = false;
+                generation = offeredGeneration;
+            }
+            const double e = system.energy();
+            std::lock_guard<std::mutex> lock(mutex);
+            if (generation != resultGeneration) {
+                resultGeneration = generation;
+                reference = e;
+                latestDrift = 0.0;
+            } else if (reference != 0.0) {
+                latestDrift = std::abs((e - reference) / reference);
+            }
+            busy = false;
+        }
+    }
+};
+
+struct Body {
+    uint32_t id;
+    double x, y, z, vx, vy, vz, m;
+    double r;                   // collision radius, 0 for a point
+};
+
+// Body state after a tick. Bodies are kept sorted by id, so two snapshots
+// (or a snapshot and the caller's own list) can be matched by a merge walk.
+struct Snapshot {
+    uint64_t tick = 0;
+    double time = 0.0;          // simulated seconds
+    double published = 0.0;     // wallSeconds() when the tick finished
+    double energyDrift = 0.0;   // relative energy error since the body set last changed, 0 if not estimated
+    uint64_t commands = 0;      // add() and remove() calls applied so far
+    std::vector<uint32_t> id;
+    std::vector<double> x, y, z, vx, vy, vz, m, r;
+};
+
+// nbody::System stepped by a FixedStepLoop. Set config, dt and stepsPerTick,
+// load() or add() the initial bodies and start(); everything else is safe to call from
+// the render thread while it runs.
+class PhysicsThread {
+public:
+    nbody::Config config;
+    double dt = 1.0;            // simulated seconds per leapfrog step
+    int stepsPerTick = 1;
+    int tickEvent = -1;         // telemetry event for each stepped tick (ms, bodies), -1 for none
+    int mergeEvent = -1;        // telemetry event for ticks with collisions (bodies absorbed, pairs)
+    size_t energyMaxBodies = 100000;    // energy drift is not estimated above this
+    // Called on the physics thread with every snapshot before it is published;
+    // must be quick (recording::Writer::push copies and returns)
+    std::function<void(const Snapshot&)> onPublish;
+
+    ~PhysicsThread() { stop(); }
+
+    void start(double hz) {
+        period = 1.0 / hz;
+        energyInterval = std::max(1, int(hz));
+        system.config = config;
+        solver.store(int(config.solver));
+        energy.maxBodies = energyMaxBodies;
+        energy.start(config);
+        loop.start(hz, [this]() { tick(); });
+    }
+    void stop() {
+        loop.stop();
+        energy.stop();
+    }
+
+    // Replace all bodies at once, with ids 0..n-1, as points. Only before start().
+    void load(const nbody::Bodies& b) {
+        system.bodies = b;
+        ids.resize(b.size());
+        for (size_t i = 0; i < ids.size(); ++i) ids[i] = uint32_t(i);
+        radius.assign(b.size(), 0.0);
+        accelerationsValid = false;
+        bodySetChanged();
+        publish();
+    }
+
+    // Both return the command's sequence number: once a snapshot's
+    // commands count reaches it, the edit is reflected in that snapshot.
+    uint64_t add(const Body& b) {
+        std::lock_guard<std::mutex> lock(commandMutex);
+        commands.push_back(Command{ true, b });
+        return ++queued;
+    }
+    uint64_t remove(uint32_t id) {
+        std::lock_guard<std::mutex> lock(commandMutex);
+        Body b = {};
+        b.id = id;
+        commands.push_back(Command{ false, b });
+        return ++queued;
+    }
+    void setPaused(bool p) { paused.store(p, std::memory_order_relaxed); }
+    void setSolver(nbody::Solver s) { solver.store(int(s), std::memory_order_relaxed); }
+
+    // Render thread: take the newest snapshot if there is one. The one it
+    // replaces is kept for blend().
+    bool poll() {
+        if (!buffer.update()) return false;
+        std::swap(previous, current);
+        current = buffer.front();
+        return true;
+    }
+    const Snapshot& latest() const { return current; }
+
+    // The latest snapshot with positions interpolated from the previous
+    // one. The result trails the simulation by up to one tick; bodies new
+    // in the latest snapshot are taken as they are.
+    void blend(double now, Snapshot& out) const {
+        out = current;
+        double alpha = (now - current.published) / period;
+        if (!(alpha < 1.0) || previous.id.empty()) return;
+        alpha = std::max(alpha, 0.0);
+        for (size_t i = 0, j = 0; i < current.id.size(); ++i) {
+            while (j < previous.id.size() && previous.id[j] < current.id[i]) ++j;
+            if (j == previous.id.size()) break;
+            if (previous.id[j] != current.id[i]) continue;
+            out.x[i] = previous.x[j] + (current.x[i] - previous.x[j]) * alpha;
+            out.y[i] = previous.y[j] + (current.y[i] - previous.y[j]) * alpha;
+            out.z[i] = previous.z[j] + (current.z[i] - previous.z[j]) * alpha;
+        }
+    }
+
+private:
+    struct Command {
+        bool add;
+        Body body;
+    };
+
+    FixedStepLoop loop;
+    TripleBuffer<Snapshot> buffer;
+    Snapshot current, previous;     // render thread only
+
+    // physics thread only
+    nbody::System system;
+    std::vector<uint32_t> ids;
+    std::vector<double> radius;
+    collide::Merger merger;
+    std::vector<Command> pending;
+    uint64_t applied = 0;
+    uint64_t ticks = 0;
+    double simTime = 0.0;
+    EnergyMonitor energy;
+    uint64_t generation = 0;        // bumped whenever the body set changes
+    bool referenceOffered = false;  // energy has this generation's bodies
+    double energyDrift = 0.0;
+    bool accelerationsValid = false;
+    int energyInterval = 60;
+
+    // shared
+    std::mutex commandMutex;
+    std::vector<Command> commands;
+    uint64_t queued = 0;        // guarded by commandMutex
+    std::atomic<bool> paused{ false };
+    std::atomic<int> solver{ 0 };
+    double period = 1.0 / 60.0;     // written before the thread starts
+
+    void tick() {
+        bool changed = applyCommands();
+        nbody::Solver s = nbody::Solver(solver.load(std::memory_order_relaxed));
+        if (s != system.config.solver) {
+            system.config.solver = s;
+            accelerationsValid = false;
+        }
+        if (!paused.load(std::memory_order_relaxed) && system.bodies.size() > 0) {
+            double t0 = tickEvent >= 0 ? wallSeconds() : 0.0;
+            if (!accelerationsValid) system.computeAccelerations();
+            accelerationsValid = true;
+            for (int k = 0; k < stepsPerTick; ++k) system.step(dt);
+            simTime += stepsPerTick * dt;
+            ticks++;
+            changed = true;
+            if (size_t absorbed = merger.merge(system.bodies, radius, ids)) {
+                // a merge is inelastic: restart the energy reference like an edit does
+                accelerationsValid = false;
+                bodySetChanged();
+                if (mergeEvent >= 0)
+                    telemetry::log(uint16_t(mergeEvent), double(absorbed), double(merger.pairs));
+            }
+            if (!referenceOffered) referenceOffered = energy.offer(system.bodies, generation);
+            else if (ticks % energyInterval == 0) energy.offer(system.bodies, generation);
+            energyDrift = energy.drift(generation);
+            if (tickEvent >= 0)
+                telemetry::log(uint16_t(tickEvent), (wallSeconds() - t0) * 1e3, double(system.bodies.size()));
+        }
+        if (changed) publish();
+    }
+
+    bool applyCommands() {
+        {
+            std::lock_guard<std::mutex> lock(commandMutex);
+            pending.swap(commands);
+        }
+        if (pending.empty()) return false;
+        nbody::Bodies& b = system.bodies;
+        for (const Command& c : pending) {
+            size_t at = std::lower_bound(ids.begin(), ids.end(), c.body.id) - ids.begin();
+            bool present = at < ids.size() && ids[at] == c.body.id;
+            if (c.add && !present) {
+                const Body& nb = c.body;
+                ids.insert(ids.begin() + at, nb.id);
+                radius.insert(radius.begin() + at, nb.r);
+                const double v[10] = { nb.x, nb.y, nb.z, nb.vx, nb.vy, nb.vz, 0.0, 0.0, 0.0, nb.m };
+                int k = 0;
+                for (auto* arr : { &b.x, &b.y, &b.z, &b.vx, &b.vy, &b.vz, &b.ax, &b.ay, &b.az, &b.m })
+                    arr->insert(arr->begin() + at, v[k++]);
+            } else if (!c.add && present) {
+                ids.erase(ids.begin() + at);
+                radius.erase(radius.begin() + at);
+                for (auto* arr : { &b.x, &b.y, &b.z, &b.vx, &b.vy, &b.vz, &b.ax, &b.ay, &b.az, &b.m })
+                    arr->erase(arr->begin() + at);
+            }
+        }
+        applied += pending.size();
+        pending.clear();
+        accelerationsValid = false;
+        bodySetChanged();
+        return true;
+    }
+    void bodySetChanged() {
+        generation++;
+        referenceOffered = false;
+        energyDrift = 0.0;
+    }
+
+    void publish() {
+        const nbody::Bodies& b = system.bodies;
+        Snapshot& s = buffer.back();
+        s.tick = ticks;
+        s.time = simTime;
+        s.energyDrift = energyDrift;
+        s.commands = applied;
+        s.id = ids;
+        s.x = b.x; s.y = b.y; s.z = b.z;
+        s.vx = b.vx; s.vy = b.vy; s.vz = b.vz;
+        s.m = b.m;
+        s.r = radius;
+        s.published = wallSeconds();
+        if (onPublish) onPublish(s);
+        buffer.publish();
+    }
+};
+
+} // namespace sim
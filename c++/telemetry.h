@@ -0,0 +1,230 @@
+// telemetry.h - low-overhead binary event log
+//
+// Replaces console output in hot loops. Each thread that logs gets its own
+// single-producer ring of fixed-size binary records, so log() is a clock
+// read, a rate-limit check and a store, with no locks and no formatting.
+// On x86 the clock is the time-stamp counter (a few ns, invariant on any
+// recent CPU); the writer converts it to nanoseconds against steady_clock.
+// A background thread drains the rings into a file every few milliseconds;
+// telemetry_csv turns the file into CSV.
+//
+// Events are defined up front with a name, two field names and a minimum
+// interval; a thread logging the same event faster than that has the extra
+// records dropped at the source. A full ring also drops rather than blocks,
+// and the number of lost records is written as a "telemetry.dropped" event.
+//
+// File layout (little-endian):
+//   char[8] magic "BHTELEM" + NUL, u32 version (1), u32 event count
+//   per event: char name[32], char field[2][16]
+//   records to the end of the file, 32 bytes each (Record below)
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define TELEMETRY_TSC 1
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TELEMETRY_TSC 1
+#endif
+
+namespace telemetry {
+
+static const uint32_t VERSION = 1;
+static const char MAGIC[8] = { 'B', 'H', 'T', 'E', 'L', 'E', 'M', 0 };
+static const int MAX_EVENTS = 64;
+static const size_t RING_SIZE = 4096;   // records per thread, power of two
+
+struct Record {
+    uint64_t ns;        // since start(); raw clock ticks until the writer converts it
+    uint16_t event;
+    uint16_t thread;
+    uint32_t reserved;
+    double value[2];
+};
+static_assert(sizeof(Record) == 32, "telemetry record layout changed");
+
+struct EventInfo {
+    char name[32];
+    char field[2][16];
+};
+
+// One producer (the owning thread), one consumer (the writer)
+struct Ring {
+    Record records[RING_SIZE];
+    std::atomic<uint64_t> head{ 0 }, tail{ 0 };
+    std::atomic<uint64_t> dropped{ 0 };
+    uint64_t lastTicks[MAX_EVENTS] = {};
+    uint16_t thread = 0;
+};
+
+inline uint64_t clockTicks() {
+#ifdef TELEMETRY_TSC
+    return __rdtsc();
+#else
+    return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+}
+
+struct State {
+    std::atomic<bool> enabled{ false };
+    std::vector<EventInfo> events;
+    double minInterval[MAX_EVENTS] = {};        // seconds
+    uint64_t minIntervalTicks[MAX_EVENTS] = {};
+    std::chrono::steady_clock::time_point t0;
+    uint64_t ticks0 = 0;
+    double nsPerTick = 1.0;                     // refined by every drain()
+    std::mutex ringsMutex;
+    std::vector<std::unique_ptr<Ring>> rings;
+    std::thread writer;
+    FILE* file = nullptr;
+    uint16_t droppedEvent = 0;
+};
+
+inline State& state() {
+    static State s;
+    return s;
+}
+
+// Registers an event; call before start(). Returns the id to pass to log().
+inline uint16_t define(const char* name, const char* field0, const char* field1, double minIntervalSeconds = 0.0) {
+    State& s = state();
+    if (s.events.size() >= size_t(MAX_EVENTS)) return 0;
+    EventInfo e;
+    memset(&e, 0, sizeof(e));
+    strncpy(e.name, name, sizeof(e.name) - 1);
+    strncpy(e.field[0], field0, sizeof(e.field[0]) - 1);
+    strncpy(e.field[1], field1, sizeof(e.field[1]) - 1);
+    s.minInterval[s.events.size()] = minIntervalSeconds;
+    s.events.push_back(e);
+    return uint16_t(s.events.size() - 1);
+}
+
+inline Ring* threadRing() {
+    thread_local Ring* ring = nullptr;
+    if (!ring) {
+        State& s = state();
+        std::lock_guard<std::mutex> lock(s.ringsMutex);
+        s.rings.emplace_back(new Ring());
+        ring = s.rings.back().get();
+        ring->thread = uint16_t(s.rings.size() - 1);
+    }
+    return ring;
+}
+
+inline void log(uint16_t event, double a, double b = 0.0) {
+    State& s = state();
+    if (!s.enabled.load(std::memory_order_relaxed)) return;
+    uint64_t now = clockTicks();
+    Ring* r = threadRing();
+    if (r->lastTicks[event] && now - r->lastTicks[event] < s.minIntervalTicks[event]) return;
+    r->lastTicks[event] = now;
+    uint64_t head = r->head.load(std::memory_order_relaxed);
+    if (head - r->tail.load(std::memory_order_acquire) >= RING_SIZE) {
+        r->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    Record& rec = r->records[head & (RING_SIZE - 1)];
+    rec.ns = now;
+    rec.event = event;
+    rec.thread = r->thread;
+    rec.reserved = 0;
+    rec.value[0] = a;
+    rec.value[1] = b;
+    r->head.store(head + 1, std::memory_order_release);
+}
+
+// Ticks per nanosecond from the clock's progress since t0
+inline void calibrate() {
+    State& s = state();
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - s.t0).count();
+    uint64_t ticks = clockTicks() - s.ticks0;
+    if (ticks > 0 && ns > 0.0) s.nsPerTick = ns / double(ticks);
+}
+
+// Writer thread: copy everything published so far to the file
+inline void drain() {
+    State& s = state();
+    std::vector<Ring*> rings;
+    {
+        std::lock_guard<std::mutex> lock(s.ringsMutex);
+        for (auto& r : s.rings) rings.push_back(r.get());
+    }
+    calibrate();
+    Record out[256];
+    for (Ring* r : rings) {
+        uint64_t tail = r->tail.load(std::memory_order_relaxed);
+        uint64_t head = r->head.load(std::memory_order_acquire);
+        while (tail != head) {
+            size_t n = size_t(std::min<uint64_t>(head - tail, 256));
+            for (size_t k = 0; k < n; ++k) {
+                out[k] = r->records[(tail + k) & (RING_SIZE - 1)];
+                out[k].ns = uint64_t(double(out[k].ns - s.ticks0) * s.nsPerTick);
+            }
+            fwrite(out, sizeof(Record), n, s.file);
+            tail += n;
+        }
+        r->tail.store(tail, std::memory_order_release);
+        uint64_t lost = r->dropped.exchange(0, std::memory_order_relaxed);
+        if (lost) {
+            Record rec = {};
+            rec.ns = uint64_t(double(clockTicks() - s.ticks0) * s.nsPerTick);
+            rec.event = s.droppedEvent;
+            rec.thread = r->thread;
+            rec.value[0] = double(lost);
+            fwrite(&rec, sizeof(rec), 1, s.file);
+        }
+    }
+}
+
+// Opens path, writes the event table and starts the writer thread
+inline bool start(const char* path) {
+    State& s = state();
+    if (s.file) return true;
+    s.droppedEvent = define("telemetry.dropped", "records", "");
+    s.file = fopen(path, "wb");
+    if (!s.file) return false;
+    uint32_t header[2] = { VERSION, uint32_t(s.events.size()) };
+    fwrite(MAGIC, 1, sizeof(MAGIC), s.file);
+    fwrite(header, sizeof(header), 1, s.file);
+    fwrite(s.events.data(), sizeof(EventInfo), s.events.size(), s.file);
+    // rough tick rate for the rate limits; drain() keeps refining it
+    s.t0 = std::chrono::steady_clock::now();
+    s.ticks0 = clockTicks();
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    calibrate();
+    for (size_t e = 0; e < s.events.size(); ++e)
+        s.minIntervalTicks[e] = uint64_t(s.minInterval[e] * 1e9 / s.nsPerTick);
+    s.enabled.store(true);
+    s.writer = std::thread([]() {
+        State& st = state();
+        while (st.enabled.load()) {
+            drain();
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    });
+    return true;
+}
+
+// Stops logging, writes what is left and closes the file
+inline void stop() {
+    State& s = state();
+    if (!s.file) return;
+    s.enabled.store(false);
+    if (s.writer.joinable()) s.writer.join();
+    drain();
+    fclose(s.file);
+    s.file = nullptr;
+}
+
+} // namespace telemetry
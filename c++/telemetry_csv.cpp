@@ -0,0 +1,53 @@
+// telemetry_csv.cpp - converts a telemetry log (see telemetry.h) to CSV
+//
+//   ./telemetry_csv run.tlm > run.csv
+//
+// One row per record, in time order:
+//   time_s,thread,event,<field 0 name>,<value 0>,<field 1 name>,<value 1>
+#include "telemetry.h"
+#include <algorithm>
+#include <iostream>
+
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        std::cerr << "usage: " << argv[0] << " <log.tlm>" << std::endl;
+        return 1;
+    }
+    FILE* f = fopen(argv[1], "rb");
+    if (!f) {
+        std::cerr << "cannot open " << argv[1] << std::endl;
+        return 1;
+    }
+    char magic[8];
+    uint32_t header[2];
+    if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) || memcmp(magic, telemetry::MAGIC, sizeof(magic)) != 0 ||
+        fread(header, sizeof(header), 1, f) != 1) {
+        std::cerr << argv[1] << " is not a telemetry log" << std::endl;
+        return 1;
+    }
+    if (header[0] != telemetry::VERSION) {
+        std::cerr << argv[1] << ": unsupported telemetry version " << header[0] << std::endl;
+        return 1;
+    }
+    std::vector<telemetry::EventInfo> events(header[1]);
+    if (fread(events.data(), sizeof(telemetry::EventInfo), events.size(), f) != events.size()) {
+        std::cerr << argv[1] << ": truncated event table" << std::endl;
+        return 1;
+    }
+    std::vector<telemetry::Record> records;
+    telemetry::Record rec;
+    while (fread(&rec, sizeof(rec), 1, f) == 1) records.push_back(rec);
+    fclose(f);
+
+    // rings are drained one thread at a time, so restore global time order
+    std::stable_sort(records.begin(), records.end(),
+                     [](const telemetry::Record& a, const telemetry::Record& b) { return a.ns < b.ns; });
+    printf("time_s,thread,event,field0,value0,field1,value1\n");
+    for (const auto& r : records) {
+        if (r.event >= events.size()) continue;
+        const telemetry::EventInfo& e = events[r.event];
+        printf("%.9f,%u,%s,%s,%.17g,%s,%.17g\n", r.ns * 1e-9, unsigned(r.thread), e.name,
+               e.field[0], r.value[0], e.field[1], r.value[1]);
+    }
+    return 0;
+}
@@ -0,0 +1,160 @@
+// well_tree.h - hierarchical sum of gravity wells for the spacetime grids
+//
+// Both grids displace a vertex by a sum over bodies of sqrt(r_s (r - r_s))
+// (Flamm's paraboloid), which is O(vertices x bodies). Tree is a quadtree
+// over the bodies' xz positions. A node far enough from the evaluation
+// point counts as one term W sqrt(r - s). W is the sum of sqrt(r_s). r is
+// measured to the centroid weighted by sqrt(r_s), and s is the weighted mean
+// r_s, so the first-order error in both cancels. Nearby leaves are summed
+// body by body.
+//
+// A node is far when extent < theta * r. Its second-order remainder is then
+// at most theta^2 / (4 (1 - theta)^1.5) of its own contribution, which is
+// how setTolerance() picks theta. Every term has the same sign, so the
+// tolerance also bounds the relative error of the whole sum.
+//
+// Nodes are stored depth-first. Each records the index of the next node
+// outside its subtree ("skip"), so the tree can be walked without a stack.
+// grid.vert walks the copy that black_hole.cpp uploads to a texture buffer
+// this way.
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+namespace wells {
+
+struct Node {
+    float x, y, z;      // centroid, weighted by sqrt(r_s)
+    float weight;       // sum of sqrt(r_s)
+    float extent;       // max over bodies of |p - centroid| + r_s
+    float shift;        // mean r_s, weighted by sqrt(r_s)
+    int skip;           // next node outside this subtree
+    int first, count;   // bodies in tree order; count is 0 for inner nodes
+};
+
+// Largest theta whose far-field error stays within tolerance
+inline float thetaForTolerance(float tolerance) {
+    float lo = 0.0f, hi = 0.99f;
+    for (int k = 0; k < 40; ++k) {
+        float t = 0.5f * (lo + hi);
+        if (t * t / (4.0f * std::pow(1.0f - t, 1.5f)) > tolerance) hi = t;
+        else lo = t;
+    }
+    return lo;
+}
+
+class Tree {
+public:
+    static const int LEAF_SIZE = 8;
+    static const int MAX_DEPTH = 24;    // coincident bodies stop here
+
+    std::vector<Node> nodes;
+    std::vector<float> x, y, z, rs;     // bodies in tree order
+    float theta = thetaForTolerance(1e-2f);
+
+    void setTolerance(float tolerance) { theta = thetaForTolerance(tolerance); }
+
+    // Bodies as parallel arrays, r_s in the unit of the positions. py may be
+    // null for bodies in the grid plane.
+    void build(const float* px, const float* py, const float* pz, const float* prs, size_t n) {
+        nodes.clear();
+        order.resize(n);
+        for (size_t i = 0; i < n; ++i) order[i] = int(i);
+        if (n > 0) {
+            float x0 = px[0], x1 = px[0], z0 = pz[0], z1 = pz[0];
+            for (size_t i = 1; i < n; ++i) {
+                x0 = std::min(x0, px[i]); x1 = std::max(x1, px[i]);
+                z0 = std::min(z0, pz[i]); z1 = std::max(z1, pz[i]);
+            }
+            float half = 0.5f * std::max(x1 - x0, z1 - z0);
+            buildNode(px, py, pz, prs, 0, int(n), 0.5f * (x0 + x1), 0.5f * (z0 + z1), half, 0);
+        }
+        x.resize(n); y.resize(n); z.resize(n); rs.resize(n);
+        for (size_t k = 0; k < n; ++k) {
+            int i = order[k];
+            x[k] = px[i];
+            y[k] = py ? py[i] : 0.0f;
+            z[k] = pz[i];
+            rs[k] = prs[i];
+        }
+    }
+
+    // Sum over all bodies seen from (px, py, pz): far(node, r) for nodes that
+    // pass the opening test, exact(k) for bodies k of the leaves that do not
+    template <class Far, class Exact>
+    float sum(float px, float py, float pz, Far far, Exact exact) const {
+        float total = 0.0f;
+        const int n = int(nodes.size());
+        for (int i = 0; i < n;) {
+            const Node& node = nodes[i];
+            float dx = node.x - px, dy = node.y - py, dz = node.z - pz;
+            float r = std::sqrt(dx * dx + dy * dy + dz * dz);
+            if (node.extent < theta * r) {
+                total += far(node, r);
+                i = node.skip;
+            } else if (node.count > 0) {
+                for (int k = node.first; k < node.first + node.count; ++k) total += exact(k);
+                i = node.skip;
+            } else {
+                ++i;
+            }
+        }
+        return total;
+    }
+
+private:
+    std::vector<int> order;
+
+    void buildNode(const float* px, const float* py, const float* pz, const float* prs,
+                   int first, int count, float cx, float cz, float half, int depth) {
+        const int index = int(nodes.size());
+        nodes.push_back(Node());
+        Node node = {};
+        double sx = 0.0, sy = 0.0, sz = 0.0, srs = 0.0, w = 0.0;
+        for (int k = first; k < first + count; ++k) {
+            int i = order[k];
+            double s = std::sqrt(double(prs[i]));
+            sx += s * px[i]; sy += s * (py ? py[i] : 0.0f); sz += s * pz[i];
+            srs += s * prs[i];
+            w += s;
+        }
+        int i0 = order[first];
+        node.x = w > 0.0 ? float(sx / w) : px[i0];
+        node.y = w > 0.0 ? float(sy / w) : (py ? py[i0] : 0.0f);
+        node.z = w > 0.0 ? float(sz / w) : pz[i0];
+        node.weight = float(w);
+        node.shift = w > 0.0 ? float(srs / w) : 0.0f;
+        for (int k = first; k < first + count; ++k) {
+            int i = order[k];
+            float dx = px[i] - node.x, dy = (py ? py[i] : 0.0f) - node.y, dz = pz[i] - node.z;
+            node.extent = std::max(node.extent, std::sqrt(dx * dx + dy * dy + dz * dz) + prs[i]);
+        }
+
+        if (count <= LEAF_SIZE || depth == MAX_DEPTH) {
+            node.first = first;
+            node.count = count;
+        } else {
+            // quadrants: split on z, then each half on x
+            int* b = order.data() + first;
+            int* e = b + count;
+            int* mz = std::partition(b, e, [&](int i) { return pz[i] < cz; });
+            int* mx0 = std::partition(b, mz, [&](int i) { return px[i] < cx; });
+            int* mx1 = std::partition(mz, e, [&](int i) { return px[i] < cx; });
+            const float q = 0.5f * half;
+            int* bounds[5] = { b, mx0, mz, mx1, e };
+            const float centres[4][2] = { { cx - q, cz - q }, { cx + q, cz - q }, { cx - q, cz + q }, { cx + q, cz + q } };
+            for (int c = 0; c < 4; ++c) {
+                int n = int(bounds[c + 1] - bounds[c]);
+                if (n > 0)
+                    buildNode(px, py, pz, prs, int(bounds[c] - order.data()), n, centres[c][0], centres[c][1], q, depth + 1);
+            }
+        }
+        node.skip = int(nodes.size());
+        nodes[index] = node;
+    }
+};
+
+} // namespace wells